@@ -0,0 +1,325 @@
+/*
+ * Microbenchmark of the hash table: the Robin Hood table of hashtab.c
+ * against the chained table it replaced, which is kept below as it was.
+ *
+ * The identifiers of the files given on the command line are looked up in
+ * both tables, in the order they occur in the files. Two workloads are
+ * timed: find-or-insert into an empty table, which is what the symbol table
+ * does while a translation unit is being read, and search only, with all
+ * identifiers already in the table.
+ *
+ * Usage: bench-hashtab [-r REPS] FILE...
+ */
+
+#include "common.h"
+#include "hashtab.h"
+#include "mempool.h"
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_REPS	5
+
+/******************************** the chained table ********************************/
+
+struct chainnode
+{
+	char *key;
+	struct chainnode *next;
+};
+
+struct chaintab
+{
+	struct chainnode *table;
+	struct mempool keys;
+	size_t count;
+	size_t size;
+};
+
+/*
+ * The sdbm hash, see http://www.cse.yorku.ca/~oz/hash.html#sdbm.
+ */
+static inline uint64_t chaintab_hash(char *key)
+{
+	uint64_t hash = 0;
+	int c;
+
+	while ((c = *key++))
+		hash = c + (hash << 6) + (hash << 16) - hash;
+
+	return hash;
+}
+
+static void chaintab_insert_internal(struct chaintab *chaintab, struct chainnode *new_node)
+{
+	uint64_t hash = chaintab_hash(new_node->key) % chaintab->size;
+	struct chainnode *node;
+
+	node = &chaintab->table[hash];
+	new_node->next = node->next;
+	node->next = new_node;
+}
+
+static void chaintab_resize(struct chaintab *chaintab, size_t new_size)
+{
+	struct chainnode *old_table;
+	size_t old_size;
+	struct chainnode *node, *tmp_node;
+	size_t i;
+
+	old_table = chaintab->table;
+	old_size = chaintab->size;
+
+	chaintab->table = calloc(new_size, sizeof(*chaintab->table));
+	chaintab->size = new_size;
+
+	for (i = 0; i < old_size; i++) {
+		node = old_table[i].next;
+
+		while (node) {
+			tmp_node = node->next;
+			chaintab_insert_internal(chaintab, node);
+			node = tmp_node;
+		}
+	}
+
+	free(old_table);
+}
+
+static void chaintab_init(struct chaintab *chaintab, size_t init_size)
+{
+	chaintab->table = NULL;
+	chaintab->size = 0;
+	chaintab->count = 0;
+	mempool_init(&chaintab->keys, 1024);
+	chaintab_resize(chaintab, init_size);
+}
+
+static void chaintab_free(struct chaintab *chaintab)
+{
+	mempool_free(&chaintab->keys);
+	free(chaintab->table);
+}
+
+/*
+ * As before, the load is computed in integer arithmetic, so the table only
+ * grows once there are as many nodes as there are slots.
+ */
+static void chaintab_insert(struct chaintab *chaintab, char *key, struct chainnode *node)
+{
+	float load;
+
+	load = chaintab->count / chaintab->size;
+	if (load > 0.5)
+		chaintab_resize(chaintab, 2 * chaintab->size);
+
+	node->key = mempool_strdup(&chaintab->keys, key);
+
+	chaintab_insert_internal(chaintab, node);
+	chaintab->count++;
+}
+
+static void *chaintab_search(struct chaintab *chaintab, char *key)
+{
+	struct chainnode *cur;
+
+	cur = chaintab->table[chaintab_hash(key) % chaintab->size].next;
+	for (; cur != NULL; cur = cur->next)
+		if (strcmp(cur->key, key) == 0)
+			return cur;
+
+	return NULL;
+}
+
+/******************************** the benchmark ********************************/
+
+/*
+ * An identifier of the input. The chained table needs NUL-terminated keys,
+ * so each identifier has a copy of its own in @str, and @len is its length.
+ */
+struct ident
+{
+	char *str;
+	size_t len;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Append the identifiers of @filename to @idents, which has @count items
+ * and room for @size.
+ */
+static void read_idents(char *filename, struct ident **idents, size_t *count, size_t *size)
+{
+	FILE *file;
+	char *buf;
+	long len;
+	char *p, *start;
+
+	file = fopen(filename, "r");
+	if (!file) {
+		fprintf(stderr, "Cannot open '%s'\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	fseek(file, 0, SEEK_END);
+	len = ftell(file);
+	rewind(file);
+
+	buf = mcc_malloc(len + 1);
+	len = fread(buf, 1, len, file);
+	buf[len] = '\0';
+	fclose(file);
+
+	for (p = buf; *p != '\0';) {
+		if (!isalpha((unsigned char)*p) && *p != '_') {
+			p++;
+			continue;
+		}
+
+		for (start = p; isalnum((unsigned char)*p) || *p == '_'; p++)
+			;
+
+		if (*count == *size) {
+			*size *= 2;
+			*idents = mcc_realloc(*idents, *size * sizeof(**idents));
+		}
+
+		(*idents)[*count].str = strndup(start, p - start);
+		(*idents)[*count].len = p - start;
+		(*count)++;
+	}
+
+	free(buf);
+}
+
+static size_t fill_chaintab(struct chaintab *table, struct chainnode *nodes,
+	struct ident *idents, size_t count)
+{
+	size_t num_nodes = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (!chaintab_search(table, idents[i].str))
+			chaintab_insert(table, idents[i].str, &nodes[num_nodes++]);
+
+	return num_nodes;
+}
+
+static size_t fill_hashtab(struct hashtab *table, struct hashnode *nodes,
+	struct ident *idents, size_t count)
+{
+	size_t num_nodes = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (!hashtab_search(table, idents[i].str, idents[i].len))
+			hashtab_insert(table, idents[i].str, idents[i].len, &nodes[num_nodes++]);
+
+	return num_nodes;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ident *idents;
+	size_t count = 0, size = 1024;
+	struct chaintab chaintab;
+	struct chainnode *chainnodes;
+	struct hashtab hashtab;
+	struct hashnode *hashnodes;
+	size_t distinct_chained = 0, distinct = 0;
+	size_t hits = 0;
+	double t0, t1, t2;
+	int reps = DEFAULT_REPS;
+	int arg, r;
+	size_t i;
+
+	idents = mcc_malloc(size * sizeof(*idents));
+
+	for (arg = 1; arg < argc; arg++) {
+		if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc)
+			reps = atoi(argv[++arg]);
+		else
+			read_idents(argv[arg], &idents, &count, &size);
+	}
+
+	if (count == 0 || reps < 1) {
+		fprintf(stderr, "Usage: %s [-r REPS] FILE...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	chainnodes = mcc_malloc(count * sizeof(*chainnodes));
+	hashnodes = mcc_malloc(count * sizeof(*hashnodes));
+
+	/* find-or-insert from an empty table */
+	t0 = now();
+	for (r = 0; r < reps; r++) {
+		chaintab_init(&chaintab, 256);
+		distinct_chained = fill_chaintab(&chaintab, chainnodes, idents, count);
+		chaintab_free(&chaintab);
+	}
+
+	t1 = now();
+	for (r = 0; r < reps; r++) {
+		hashtab_init(&hashtab, NULL, 256);
+		distinct = fill_hashtab(&hashtab, hashnodes, idents, count);
+		hashtab_free(&hashtab);
+	}
+
+	t2 = now();
+
+	if (distinct != distinct_chained) {
+		fprintf(stderr, "The tables disagree: %zu vs %zu distinct identifiers\n",
+			distinct_chained, distinct);
+		return EXIT_FAILURE;
+	}
+
+	printf("%zu lookups, %zu distinct identifiers, %d repetitions\n", count, distinct, reps);
+	printf("find-or-insert from empty: chained %5.1f ns, Robin Hood %5.1f ns\n",
+		(t1 - t0) / reps / count * 1e9, (t2 - t1) / reps / count * 1e9);
+
+	/* search only, all identifiers are hits */
+	chaintab_init(&chaintab, 256);
+	fill_chaintab(&chaintab, chainnodes, idents, count);
+	hashtab_init(&hashtab, NULL, 256);
+	fill_hashtab(&hashtab, hashnodes, idents, count);
+
+	t0 = now();
+	for (r = 0; r < reps; r++)
+		for (i = 0; i < count; i++)
+			hits += chaintab_search(&chaintab, idents[i].str) != NULL;
+
+	t1 = now();
+	for (r = 0; r < reps; r++)
+		for (i = 0; i < count; i++)
+			hits += hashtab_search(&hashtab, idents[i].str, idents[i].len) != NULL;
+
+	t2 = now();
+
+	if (hits != 2 * reps * count) {
+		fprintf(stderr, "Some searches failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("search only (all hits):    chained %5.1f ns, Robin Hood %5.1f ns\n",
+		(t1 - t0) / reps / count * 1e9, (t2 - t1) / reps / count * 1e9);
+
+	chaintab_free(&chaintab);
+	hashtab_free(&hashtab);
+	free(chainnodes);
+	free(hashnodes);
+	for (i = 0; i < count; i++)
+		free(idents[i].str);
+	free(idents);
+
+	return EXIT_SUCCESS;
+}
@@ -4,20 +4,35 @@
 #define TOKEN_POOL_BLOCK_SIZE	256
 #define TOKEN_DATA_BLOCK_SIZE	1024
 
-void context_init(struct context *ctx)
+/*
+ * Initialize a context which reads the source files through @filecache.
+ * The file cache may be shared by contexts used in different threads, it
+ * must outlive all of them.
+ */
+void context_init_shared(struct context *ctx, struct filecache *filecache)
 {
 	mempool_init(&ctx->token_data, TOKEN_DATA_BLOCK_SIZE);
 	objpool_init(&ctx->token_pool, sizeof(struct token), TOKEN_POOL_BLOCK_SIZE);
 	symtab_init(&ctx->symtab);
-	errlist_init(&ctx->errlist);
+	srcmgr_init(&ctx->srcmgr, filecache);
+	errlist_init(&ctx->errlist, &ctx->srcmgr);
 	objpool_init(&ctx->exprs, sizeof(struct ast_expr), 16);
 }
 
+void context_init(struct context *ctx)
+{
+	filecache_init(&ctx->filecache);
+	context_init_shared(ctx, &ctx->filecache);
+}
+
 void context_free(struct context *ctx)
 {
 	mempool_free(&ctx->token_data);
 	objpool_free(&ctx->token_pool);
 	errlist_free(&ctx->errlist);
+	srcmgr_free(&ctx->srcmgr);
+	if (ctx->srcmgr.filecache == &ctx->filecache)
+		filecache_free(&ctx->filecache);
 	symtab_free(&ctx->symtab);
 	objpool_free(&ctx->exprs);
 }
@@ -8,6 +8,7 @@
 
 #include "context.h"
 #include "cpp-internal.h"
+#include <string.h>
 
 #define VA_ARGS_NAME	"__VA_ARGS__"
 
@@ -48,7 +49,7 @@ void cpp_setup_symtab_directives(struct symtab *table)
 	size_t i;
 
 	for (i = 0; i < ARRAY_SIZE(dirinfos); i++) {
-		symbol = symtab_insert(table, dirinfos[i].name);
+		symbol = symtab_find_or_insert(table, dirinfos[i].name);
 		def = symbol_define(table, symbol);
 		def->type = SYMBOL_TYPE_CPP_DIRECTIVE;
 		def->directive = (enum cpp_directive)i;
@@ -65,10 +66,15 @@ static char *cpp_directive_to_string(enum cpp_directive dir)
 }
 
 /*
- * Expect any directive on the input. If it's not there, issue an error.
+ * Expect any directive on the input. If it's not there, issue an error,
+ * unless we're in a skipped group, where anything may follow the `#'.
  */
 static bool expect_directive(struct cpp *cpp)
 {
+	if (cpp_is_skip_mode(cpp))
+		return token_is(cpp->token, TOKEN_NAME)
+			&& cpp->token->symbol->def->type == SYMBOL_TYPE_CPP_DIRECTIVE;
+
 	if (!cpp_expect(cpp, TOKEN_NAME))
 		return false;
 
@@ -154,29 +160,6 @@ struct cpp_if
 	bool skip_next_branch;		/* should the next branch be skipped? */
 };
 
-/*
- * ``Artificial'' item to be kept at the bottom of the if stack to avoid 
- * special cases in the code. Its presence is equivalent to the whole file 
- * being wrapped in a big #if 1 ... #endif directive.
- */
-static struct cpp_if ifstack_bottom = {
-	.token = NULL,
-	.skip_this_branch = false,
-	.skip_next_branch = true /* no other branches */
-};
-
-/*
- * Initialize the stack of `cpp_if' structures. The stack represents the 
- * currently processed (``open'') #if directives. Whenever an #if block 
- * ends with an #endif, the matching `cpp_if' structure is popped off the 
- * stack.
- */
-void cpp_init_ifstack(struct cpp *cpp)
-{
-	list_init(&cpp->ifs);
-	list_insert(&cpp->ifs, &ifstack_bottom.list_node);
-}
-
 /*
  * Allocate and push a new `cpp_if' structure onto the #if stack and 
  * initialize and return it. The @token shall be the [if] token.
@@ -196,6 +179,24 @@ static struct cpp_if *push_if(struct cpp *cpp, struct token *token)
 	return cpp_if;
 }
 
+/*
+ * Initialize the stack of `cpp_if' structures. The stack represents the
+ * currently processed (``open'') #if directives. Whenever an #if block
+ * ends with an #endif, the matching `cpp_if' structure is popped off the
+ * stack.
+ *
+ * An ``artificial'' item is kept at the bottom of the stack to avoid
+ * special cases in the code. Its presence is equivalent to the whole file
+ * being wrapped in a big #if 1 ... #endif directive. Each preprocessor has
+ * its own, since the list links it to the items above it.
+ */
+void cpp_init_ifstack(struct cpp *cpp)
+{
+	list_init(&cpp->ifs);
+	cpp->ifstack_bottom = push_if(cpp, NULL);
+	cpp->ifstack_bottom->skip_next_branch = true; /* no other branches */
+}
+
 /*
  * Pop a `cpp_if' structure off the #if stack.
  */
@@ -222,6 +223,91 @@ bool cpp_is_skip_mode(struct cpp *cpp)
 	return top_if(cpp)->skip_this_branch;
 }
 
+/******************************** multiple-include optimization ********************************/
+
+/*
+ * Start watching @file, which is about to be included, for an include guard.
+ * See `enum cpp_mi_state'.
+ */
+void cpp_mi_begin(struct cpp *cpp, struct cpp_file *file)
+{
+	file->mi_state = CPP_MI_START;
+	file->mi_guard = NULL;
+	file->mi_if = NULL;
+	file->outer_if = top_if(cpp);
+}
+
+/*
+ * Record the include guard of @file, which is being closed, if it has one.
+ */
+void cpp_mi_end(struct cpp *cpp, struct cpp_file *file)
+{
+	(void) cpp;
+
+	if (file->mi_state == CPP_MI_AFTER_GUARD)
+		file->info->guard = file->mi_guard;
+	else
+		file->info->guard = NULL;
+}
+
+/*
+ * Is the current file at its outermost level, i.e. outside of all #if
+ * blocks of its own?
+ */
+static bool mi_is_outer_level(struct cpp *cpp, struct cpp_file *file)
+{
+	return top_if(cpp) == file->outer_if;
+}
+
+/*
+ * Note that a token of the current file is about to be output or expanded.
+ * If it's not within the #ifndef GUARD block, the file isn't guarded, even
+ * if the token is a macro invocation which expands to nothing.
+ */
+void cpp_mi_token(struct cpp *cpp)
+{
+	struct cpp_file *file = cpp_this_file(cpp);
+
+	if (file->mi_state != CPP_MI_NONE && mi_is_outer_level(cpp, file))
+		file->mi_state = CPP_MI_NONE;
+}
+
+/*
+ * Note that the directive @dir of the current file is about to be processed.
+ * The only directive allowed outside of the #ifndef GUARD block is the
+ * #ifndef which opens it.
+ */
+static void mi_directive(struct cpp *cpp, enum cpp_directive dir)
+{
+	struct cpp_file *file = cpp_this_file(cpp);
+	struct token *guard;
+
+	if (file->mi_state == CPP_MI_NONE)
+		return;
+
+	if (file->mi_state == CPP_MI_IN_GUARD && top_if(cpp) == file->mi_if) {
+		if (dir == CPP_DIRECTIVE_ELIF || dir == CPP_DIRECTIVE_ELSE)
+			file->mi_state = CPP_MI_NONE;
+		else if (dir == CPP_DIRECTIVE_ENDIF)
+			file->mi_state = CPP_MI_AFTER_GUARD;
+		return;
+	}
+
+	if (!mi_is_outer_level(cpp, file))
+		return;
+
+	if (file->mi_state == CPP_MI_START && dir == CPP_DIRECTIVE_IFNDEF) {
+		guard = cpp_peek(cpp);
+		if (token_is(guard, TOKEN_NAME) && !guard->is_at_bol) {
+			file->mi_state = CPP_MI_IN_GUARD;
+			file->mi_guard = guard->symbol;
+			return;
+		}
+	}
+
+	file->mi_state = CPP_MI_NONE;
+}
+
 /******************************** directive handlers ********************************/
 
 /*
@@ -325,6 +411,8 @@ static void process_define(struct cpp *cpp)
 		move_next_eol(cpp);
 	}
 
+	macro_compile(&macro_def->macro);
+
 	//symtab_dump(&cpp->ctx->symtab, stderr);
 }
 
@@ -379,6 +467,30 @@ static void process_error(struct cpp *cpp)
 	skip_rest_of_line(cpp);
 }
 
+/*
+ * Process the #pragma directive. Only #pragma once is supported, all other
+ * pragmas are ignored.
+ */
+static void process_pragma(struct cpp *cpp)
+{
+	move_next_eol(cpp); /* directive name (pragma) */
+
+	if (cpp_is_skip_mode(cpp)) {
+		skip_rest_of_line(cpp);
+		return;
+	}
+
+	if (token_is(cpp->token, TOKEN_NAME)
+		&& symbol_get_name(cpp->token->symbol) == cpp->name_once) {
+		cpp_this_file(cpp)->info->once = true;
+		move_next_eol(cpp);
+		require_eol(cpp);
+		return;
+	}
+
+	skip_rest_of_line(cpp);
+}
+
 /*
  * TODO warn if tokens skipped
  */
@@ -402,13 +514,12 @@ static void process_include(struct cpp *cpp)
 	 */
 	filename = cpp->token->str;
 	DEBUG_EXPR("%s", filename);
-	file = objpool_alloc(&cpp->file_pool);
 
 	if (token_is(cpp->token, TOKEN_HEADER_HNAME)) {
-		err = cpp_file_include_hheader(cpp, filename, file);
+		err = cpp_file_include_hheader(cpp, filename, &file);
 	}
 	else if (token_is(cpp->token, TOKEN_HEADER_QNAME)) {
-		err = cpp_file_include_qheader(cpp, filename, file);
+		err = cpp_file_include_qheader(cpp, filename, &file);
 	}
 	else {
 		cpp_error(cpp, "header name was expected, got %s",
@@ -419,7 +530,8 @@ static void process_include(struct cpp *cpp)
 
 	if (err == MCC_ERROR_OK) {
 		skip_rest_of_line(cpp); /* get rid of those tokens now */
-		cpp_file_include(cpp, file);
+		if (file) /* NULL if the file needn't be included again */
+			cpp_file_include(cpp, file);
 	}
 	else {
 		cpp_error(cpp, "cannot include file %s: %s", filename, error_str(err));
@@ -427,6 +539,62 @@ static void process_include(struct cpp *cpp)
 	}
 }
 
+/*
+ * Values of the `defined' operator.
+ */
+static struct token defined_false = {
+	.type = TOKEN_NUMBER,
+	.spelling = "0",
+	.str = "0",
+};
+
+static struct token defined_true = {
+	.type = TOKEN_NUMBER,
+	.spelling = "1",
+	.str = "1",
+};
+
+/*
+ * Read the rest of the line, the controlling expression of an #if or #elif,
+ * into @expr. The operands of the `defined' operator mustn't be expanded,
+ * so the operators are evaluated right away. Return false on errors.
+ */
+static bool read_condition(struct cpp *cpp, struct toklist *expr)
+{
+	bool parens;
+	bool defined;
+
+	while (!token_is_eol_or_eof(cpp->token)) {
+		if (!token_is(cpp->token, TOKEN_NAME)
+			|| symbol_get_name(cpp->token->symbol) != cpp->name_defined) {
+			toklist_insert(expr, cpp->token);
+			move_next_eol(cpp);
+			continue;
+		}
+
+		move_next_eol(cpp); /* defined */
+		parens = token_is(cpp->token, TOKEN_LPAREN);
+		if (parens)
+			move_next_eol(cpp);
+
+		if (!cpp_expect(cpp, TOKEN_NAME))
+			return false;
+
+		defined = token_is_macro(cpp->token);
+		move_next_eol(cpp);
+
+		if (parens) {
+			if (!cpp_expect(cpp, TOKEN_RPAREN))
+				return false;
+			move_next_eol(cpp);
+		}
+
+		toklist_insert(expr, defined ? &defined_true : &defined_false);
+	}
+
+	return true;
+}
+
 /*
  * Evaluate the controlling expression of an #if/#elif/#else/#ifdef/#ifndef.
  * Return true when the expression evaluates to non-zero value, false otherwise.
@@ -434,9 +602,17 @@ static void process_include(struct cpp *cpp)
 static bool eval_expr(struct cpp *cpp)
 {
 	enum cpp_directive dir;
+	struct toklist expr;
+	struct toklist expansion;
+	struct mempool_mark mark;
+	struct errlist *errlist = &cpp->ctx->errlist;
+	size_t num_errors;
+	srcloc_t loc;
 	bool defined;
+	bool result;
 
 	dir = cpp->token->symbol->def->directive;
+	loc = cpp->token->loc;
 	move_next_eol(cpp); /* directive name */
 
 	if (dir == CPP_DIRECTIVE_IFDEF || dir == CPP_DIRECTIVE_IFNDEF) {
@@ -451,7 +627,31 @@ static bool eval_expr(struct cpp *cpp)
 		return true;
 
 	if (dir == CPP_DIRECTIVE_IF || dir == CPP_DIRECTIVE_ELIF) {
-		return true; /* TODO */
+		toklist_init(&expr);
+		toklist_init(&expansion);
+
+		if (read_condition(cpp, &expr)) {
+			/* the expansion is only needed for the evaluation */
+			mark = mempool_get_mark(&cpp->scratch);
+			num_errors = errlist->num_errors_by_level[ERROR_LEVEL_ERROR];
+			macro_expand_list(cpp, &expr, &expansion);
+
+			/* don't evaluate what's left of a broken invocation */
+			if (errlist->num_errors_by_level[ERROR_LEVEL_ERROR] == num_errors)
+				result = cpp_eval_expr(cpp, &expansion, loc);
+			else
+				result = false;
+
+			mempool_release(&cpp->scratch, mark);
+		}
+		else {
+			skip_rest_of_line(cpp);
+			result = false;
+		}
+
+		toklist_free(&expr);
+		toklist_free(&expansion);
+		return result;
 	}
 
 	assert(0);
@@ -506,6 +706,7 @@ static void process_condition(struct cpp *cpp)
 {
 	enum cpp_directive dir = cpp->token->symbol->def->directive;
 	struct cpp_if *cur_if;
+	struct cpp_file *file;
 	bool skip_outer;
 	
 	/*
@@ -522,6 +723,11 @@ static void process_condition(struct cpp *cpp)
 		skip_outer = top_if(cpp)->skip_this_branch;
 		cur_if = push_if(cpp, cpp->token);
 		cur_if->skip_next_branch = skip_outer;
+
+		/* the #ifndef GUARD block, see `mi_directive' */
+		file = cpp_this_file(cpp);
+		if (file->mi_state == CPP_MI_IN_GUARD && !file->mi_if)
+			file->mi_if = cur_if;
 	} else {
 		cur_if = top_if(cpp);
 	}
@@ -530,7 +736,7 @@ static void process_condition(struct cpp *cpp)
 	 * If this was an #elif/#else/#endif directive and there's no matching
 	 * #if/#ifdef/#ifndef directive, it's an error.
 	 */
-	if (cur_if == &ifstack_bottom) {
+	if (cur_if == cpp->ifstack_bottom) {
 		cpp_error(cpp, "%s without a matching #if/#ifdef/#ifndef directive",
 			cpp_directive_to_string(dir));
 		require_eol(cpp);
@@ -596,6 +802,8 @@ void cpp_process_directive(struct cpp *cpp)
 	 * processed separately by `process_condition' for convenience.
 	 */
 	dir = cpp->token->symbol->def->directive;
+	mi_directive(cpp, dir);
+
 	switch (dir) {
 	case CPP_DIRECTIVE_DEFINE:
 		process_define(cpp);
@@ -609,6 +817,9 @@ void cpp_process_directive(struct cpp *cpp)
 	case CPP_DIRECTIVE_ERROR:
 		process_error(cpp);
 		break;
+	case CPP_DIRECTIVE_PRAGMA:
+		process_pragma(cpp);
+		break;
 	default:
 		process_condition(cpp);
 	}
@@ -0,0 +1,426 @@
+/*
+ * See 6.10.1 Conditional inclusion.
+ *
+ * Evaluation of the controlling expressions of #if and #elif. By the time
+ * the expression gets here, the `defined' operators have been evaluated
+ * and the macros expanded, see `eval_expr' in cpp-directives.c.
+ *
+ * The expression is evaluated straight from the list of tokens, without
+ * building a tree: binary operators are parsed by precedence climbing and
+ * the operands which aren't to be evaluated (short-circuiting, the ternary
+ * operator) are parsed with evaluation turned off.
+ */
+
+#include "cpp-internal.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+
+/*
+ * Value of a (sub)expression. All integer types act as if they had the
+ * same representation as intmax_t or uintmax_t, see 6.10.1p4. The value
+ * is kept in @u; for signed values, it's the two's complement bit pattern.
+ */
+struct cpp_value
+{
+	uintmax_t u;			/* the value */
+	bool is_unsigned;		/* is it uintmax_t rather than intmax_t? */
+};
+
+/*
+ * State of the evaluation of a single expression.
+ */
+struct cpp_expr
+{
+	struct cpp *cpp;
+	struct toklist *tokens;		/* tokens of the expression */
+	size_t pos;			/* position of the current token */
+	srcloc_t end_loc;		/* location for errors at the end */
+	bool error;			/* was an error reported? */
+};
+
+static struct cpp_value expr_cond(struct cpp_expr *expr, bool eval);
+
+static struct token *expr_token(struct cpp_expr *expr)
+{
+	return toklist_at(expr->tokens, expr->pos);
+}
+
+/*
+ * Report an error at the current token. Only the first error of an
+ * expression is reported, the rest is usually a consequence of it.
+ */
+static void expr_error(struct cpp_expr *expr, char *msg)
+{
+	struct token *token = expr_token(expr);
+
+	if (expr->error)
+		return;
+
+	expr->error = true;
+	if (token)
+		cpp_error_at(expr->cpp, token->loc, "%s before `%s' in #if", msg,
+			token_get_spelling(token));
+	else
+		cpp_error_at(expr->cpp, expr->end_loc, "%s at the end of #if", msg);
+}
+
+static bool expr_accept(struct cpp_expr *expr, enum token_type type)
+{
+	struct token *token = expr_token(expr);
+
+	if (token && token_is(token, type)) {
+		expr->pos++;
+		return true;
+	}
+
+	return false;
+}
+
+static struct cpp_value value_signed(intmax_t i)
+{
+	return (struct cpp_value){ .u = (uintmax_t)i, .is_unsigned = false };
+}
+
+static bool value_is_true(struct cpp_value v)
+{
+	return v.u != 0;
+}
+
+static bool value_is_negative(struct cpp_value v)
+{
+	return !v.is_unsigned && (intmax_t)v.u < 0;
+}
+
+/*
+ * Evaluate the integer constant @token (a pp-number). See 6.4.4.1.
+ */
+static struct cpp_value eval_number(struct cpp_expr *expr, struct token *token)
+{
+	struct cpp_value v = { .u = 0, .is_unsigned = false };
+	char *str = token->str;
+	char *end;
+	bool is_decimal;
+
+	is_decimal = (str[0] != '0');
+
+	errno = 0;
+	v.u = strtoumax(str, &end, 0);
+	if (errno == ERANGE) {
+		cpp_error_at(expr->cpp, token->loc, "integer constant `%s' is too large", str);
+		expr->error = true;
+		return v;
+	}
+
+	/* integer suffixes: u, l, ll and their combinations; l is meaningless here */
+	for (; *end; end++) {
+		if ((*end == 'u' || *end == 'U') && !v.is_unsigned)
+			v.is_unsigned = true;
+		else if (*end != 'l' && *end != 'L')
+			break;
+	}
+
+	if (*end || end == str) {
+		if (!expr->error)
+			cpp_error_at(expr->cpp, token->loc,
+				"`%s' is not a valid integer constant in #if", str);
+		expr->error = true;
+		return v;
+	}
+
+	if (!v.is_unsigned && v.u > INTMAX_MAX) {
+		if (is_decimal)
+			cpp_warn_at(expr->cpp, token->loc,
+				"integer constant `%s' is so large that it is unsigned", str);
+		v.is_unsigned = true;
+	}
+
+	return v;
+}
+
+/*
+ * Parse and evaluate a primary expression or a unary operator applied
+ * to one. When @eval is false, the value is of no interest.
+ */
+static struct cpp_value expr_unary(struct cpp_expr *expr, bool eval)
+{
+	struct token *token = expr_token(expr);
+	struct cpp_value v = value_signed(0);
+
+	if (!token) {
+		expr_error(expr, "expected an expression");
+		return v;
+	}
+
+	expr->pos++;
+
+	switch (token->type) {
+	case TOKEN_NUMBER:
+		return eval_number(expr, token);
+
+	case TOKEN_CHAR_CONST:
+		return value_signed(token->value);
+
+	case TOKEN_NAME:
+		/* identifiers which remain after macro expansion are zero */
+		return v;
+
+	case TOKEN_LPAREN:
+		v = expr_cond(expr, eval);
+		if (!expr_accept(expr, TOKEN_RPAREN))
+			expr_error(expr, "expected `)'");
+		return v;
+
+	case TOKEN_PLUS:
+		return expr_unary(expr, eval);
+
+	case TOKEN_MINUS:
+		v = expr_unary(expr, eval);
+		v.u = -v.u;
+		return v;
+
+	case TOKEN_OP_NEG:
+		v = expr_unary(expr, eval);
+		v.u = ~v.u;
+		return v;
+
+	case TOKEN_OP_NOT:
+		v = expr_unary(expr, eval);
+		return value_signed(!value_is_true(v));
+
+	default:
+		expr->pos--;
+		expr_error(expr, "expected an expression");
+		return v;
+	}
+}
+
+/*
+ * Precedence of binary operators, 0 for tokens which aren't one.
+ */
+static int binary_prec(struct token *token)
+{
+	if (!token)
+		return 0;
+
+	switch (token->type) {
+	case TOKEN_ASTERISK:
+	case TOKEN_OP_DIV:
+	case TOKEN_OP_MOD:
+		return 10;
+	case TOKEN_PLUS:
+	case TOKEN_MINUS:
+		return 9;
+	case TOKEN_OP_SHL:
+	case TOKEN_OP_SHR:
+		return 8;
+	case TOKEN_OP_LT:
+	case TOKEN_OP_GT:
+	case TOKEN_OP_LE:
+	case TOKEN_OP_GE:
+		return 7;
+	case TOKEN_OP_EQ:
+	case TOKEN_OP_NEQ:
+		return 6;
+	case TOKEN_AMP:
+		return 5;
+	case TOKEN_OP_XOR:
+		return 4;
+	case TOKEN_OP_BITOR:
+		return 3;
+	case TOKEN_OP_AND:
+		return 2;
+	case TOKEN_OP_OR:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Shift @v by @count bits to the left (or to the right if @count is
+ * negative). Bits shifted out are lost, shifts by the width of the type or
+ * more yield zero (or -1 for negative values shifted to the right).
+ */
+static struct cpp_value shift(struct cpp_value v, struct cpp_value count, bool left)
+{
+	const uintmax_t width = sizeof(uintmax_t) * CHAR_BIT;
+	uintmax_t n;
+	bool negative = value_is_negative(v);
+
+	if (value_is_negative(count)) {
+		left = !left;
+		n = -count.u;
+	}
+	else {
+		n = count.u;
+	}
+
+	if (left)
+		v.u = (n >= width) ? 0 : v.u << n;
+	else if (negative)
+		v.u = (n >= width) ? UINTMAX_MAX : ~(~v.u >> n);
+	else
+		v.u = (n >= width) ? 0 : v.u >> n;
+
+	return v;
+}
+
+/*
+ * Apply the binary operator @op to @a and @b. Unless @eval is set, the
+ * result isn't used and no errors are reported.
+ */
+static struct cpp_value binary(struct cpp_expr *expr, struct token *op,
+	struct cpp_value a, struct cpp_value b, bool eval)
+{
+	bool is_unsigned = a.is_unsigned || b.is_unsigned;
+	intmax_t x = (intmax_t)a.u;
+	intmax_t y = (intmax_t)b.u;
+	struct cpp_value v = { .u = 0, .is_unsigned = is_unsigned };
+
+	switch (op->type) {
+	case TOKEN_ASTERISK:
+		v.u = a.u * b.u;
+		break;
+	case TOKEN_OP_DIV:
+	case TOKEN_OP_MOD:
+		if (b.u == 0) {
+			if (eval && !expr->error) {
+				cpp_error_at(expr->cpp, op->loc, "division by zero in #if");
+				expr->error = true;
+			}
+			break;
+		}
+
+		if (is_unsigned)
+			v.u = token_is(op, TOKEN_OP_DIV) ? a.u / b.u : a.u % b.u;
+		else if (y == -1) /* INTMAX_MIN / -1 would overflow */
+			v.u = token_is(op, TOKEN_OP_DIV) ? -a.u : 0;
+		else
+			v.u = (uintmax_t)(token_is(op, TOKEN_OP_DIV) ? x / y : x % y);
+		break;
+	case TOKEN_PLUS:
+		v.u = a.u + b.u;
+		break;
+	case TOKEN_MINUS:
+		v.u = a.u - b.u;
+		break;
+	case TOKEN_OP_SHL:
+	case TOKEN_OP_SHR:
+		return shift(a, b, token_is(op, TOKEN_OP_SHL));
+	case TOKEN_OP_LT:
+		return value_signed(is_unsigned ? a.u < b.u : x < y);
+	case TOKEN_OP_GT:
+		return value_signed(is_unsigned ? a.u > b.u : x > y);
+	case TOKEN_OP_LE:
+		return value_signed(is_unsigned ? a.u <= b.u : x <= y);
+	case TOKEN_OP_GE:
+		return value_signed(is_unsigned ? a.u >= b.u : x >= y);
+	case TOKEN_OP_EQ:
+		return value_signed(a.u == b.u);
+	case TOKEN_OP_NEQ:
+		return value_signed(a.u != b.u);
+	case TOKEN_AMP:
+		v.u = a.u & b.u;
+		break;
+	case TOKEN_OP_XOR:
+		v.u = a.u ^ b.u;
+		break;
+	case TOKEN_OP_BITOR:
+		v.u = a.u | b.u;
+		break;
+	default:
+		assert(0);
+	}
+
+	return v;
+}
+
+/*
+ * Parse and evaluate binary operators of precedence @min_prec or higher,
+ * see `binary_prec'. All of them are left-associative.
+ */
+static struct cpp_value expr_binary(struct cpp_expr *expr, int min_prec, bool eval)
+{
+	struct cpp_value lhs, rhs;
+	struct token *op;
+	int prec;
+
+	lhs = expr_unary(expr, eval);
+
+	while ((prec = binary_prec(op = expr_token(expr))) >= min_prec) {
+		expr->pos++;
+
+		if (token_is(op, TOKEN_OP_AND)) {
+			rhs = expr_binary(expr, prec + 1, eval && value_is_true(lhs));
+			lhs = value_signed(value_is_true(lhs) && value_is_true(rhs));
+		}
+		else if (token_is(op, TOKEN_OP_OR)) {
+			rhs = expr_binary(expr, prec + 1, eval && !value_is_true(lhs));
+			lhs = value_signed(value_is_true(lhs) || value_is_true(rhs));
+		}
+		else {
+			rhs = expr_binary(expr, prec + 1, eval);
+			lhs = binary(expr, op, lhs, rhs, eval);
+		}
+	}
+
+	return lhs;
+}
+
+/*
+ * Parse and evaluate a conditional expression (the ternary operator), which
+ * is also what the controlling expression is. It's right-associative.
+ */
+static struct cpp_value expr_cond(struct cpp_expr *expr, bool eval)
+{
+	struct cpp_value cond, a, b;
+	bool taken;
+
+	cond = expr_binary(expr, 1, eval);
+	if (!expr_accept(expr, TOKEN_QMARK))
+		return cond;
+
+	taken = value_is_true(cond);
+	a = expr_cond(expr, eval && taken);
+
+	if (!expr_accept(expr, TOKEN_COLON)) {
+		expr_error(expr, "expected `:'");
+		return a;
+	}
+
+	b = expr_cond(expr, eval && !taken);
+
+	/* the usual arithmetic conversions apply to both operands */
+	a.is_unsigned = b.is_unsigned = a.is_unsigned || b.is_unsigned;
+	return taken ? a : b;
+}
+
+/*
+ * Evaluate the controlling expression @tokens of an #if or #elif directive
+ * at @loc. Return true when the expression evaluates to a non-zero value,
+ * false otherwise (or if the expression is invalid).
+ */
+bool cpp_eval_expr(struct cpp *cpp, struct toklist *tokens, srcloc_t loc)
+{
+	struct cpp_expr expr;
+	struct cpp_value v;
+
+	expr.cpp = cpp;
+	expr.tokens = tokens;
+	expr.pos = 0;
+	expr.end_loc = toklist_is_empty(tokens) ? loc : toklist_last(tokens)->loc;
+	expr.error = false;
+
+	if (toklist_is_empty(tokens)) {
+		cpp_error_at(cpp, loc, "#if with no expression");
+		return false;
+	}
+
+	v = expr_cond(&expr, true);
+	if (expr_token(&expr))
+		expr_error(&expr, "missing binary operator");
+
+	return !expr.error && value_is_true(v);
+}
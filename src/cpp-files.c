@@ -1,46 +1,146 @@
+#include "array.h"
 #include "cpp-internal.h"
 #include "context.h"
+#include "symbol.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#define INBUF_BLOCK_SIZE	2048
+#define RECORDING_INIT_SIZE	256
+#define SKIPS_INIT_SIZE		8
+#define RESULT_POOL_BLOCK_SIZE	64
+#define RESULTS_INIT_SIZE	64
+#define SEARCH_DATA_BLOCK_SIZE	4096
 
 /*
- * #include <file> search paths.
+ * Directories searched after those given by -I and -isystem.
  */
-static const char *include_dirs[] = {
-	"",
-	".",
+static char *default_system_dirs[] = {
 	"/usr/include",
-	NULL,
 };
 
 /*
- * Initialize a `cpp_file' structure: open the backing input buffer
- * and initialize the lexer.
+ * Return the info of the file whose canonical path is @canon, creating it
+ * the first time the file is seen. Files are identified by their canonical
+ * path, so that all paths which lead to a file share its info.
  */
-mcc_error_t cpp_file_init(struct cpp *cpp, struct cpp_file *file, char *filename)
+static struct cpp_file_info *get_info(struct cpp *cpp, char *canon)
 {
+	struct cpp_file_info *info;
+
+	info = hashtab_search(&cpp->file_infos, canon, strlen(canon));
+	if (!info) {
+		info = objpool_alloc(&cpp->file_info_pool);
+		info->guard = NULL;
+		info->once = false;
+		info->tokens = NULL;
+		info->skips = NULL;
+		info->srcfile = NULL;
+		hashtab_insert(&cpp->file_infos, canon, strlen(canon), &info->hashnode);
+	}
+
+	return info;
+}
+
+/*
+ * Return the info of the file at @path, see `get_info'.
+ */
+static struct cpp_file_info *cpp_file_get_info(struct cpp *cpp, char *path)
+{
+	struct cpp_file_info *info;
+	char *canon;
+
+	canon = realpath(path, NULL);
+	info = get_info(cpp, canon ? canon : path);
+	free(canon);
+
+	return info;
+}
+
+/*
+ * Can the inclusion of the file described by @info be skipped? That's the
+ * case if the file contained #pragma once, or if it's guarded and the
+ * macro of its guard is defined (see `enum cpp_mi_state').
+ */
+static bool cpp_file_is_skippable(struct cpp_file_info *info)
+{
+	return info->once
+		|| (info->guard && info->guard->def->type == SYMBOL_TYPE_CPP_MACRO);
+}
+
+/*
+ * Initialize a `cpp_file' structure. If the file was lexed before (see
+ * `struct cpp_file_info'), its tokens are replayed; otherwise, open the file
+ * through the source manager, initialize the lexer and record the tokens
+ * lexed, so that they can be replayed later.
+ */
+mcc_error_t cpp_file_init(struct cpp *cpp, struct cpp_file *file, char *filename,
+	struct cpp_file_info *info)
+{
+	struct srcfile *srcfile;
 	mcc_error_t err;
 
-	if ((err = inbuf_open(&file->inbuf, INBUF_BLOCK_SIZE, filename)) != MCC_ERROR_OK)
+	file->info = info;
+	file->line_loc = SRCLOC_NONE;
+	toklist_init(&file->tokens);
+
+	if (info->tokens) {
+		DEBUG_PRINTF("Replaying %s", filename);
+		file->filename = mempool_strdup(&cpp->filenames, filename);
+		file->srcfile = NULL;
+		file->replay = info->tokens;
+		file->replay_pos = 0;
+		file->skip_pos = 0;
+		file->lexing_skip = false;
+		file->recording = NULL;
+		file->skips = NULL;
+		return MCC_ERROR_OK;
+	}
+
+	if ((err = srcmgr_open(&cpp->ctx->srcmgr, filename, &srcfile)) != MCC_ERROR_OK)
 		return err;
 
-	lexer_init(&file->lexer, cpp->ctx, &file->inbuf);
-	file->filename = mempool_strdup(&cpp->ctx->token_data, filename);
-	toklist_init(&file->tokens);
+	file->srcfile = srcfile;
+	lexer_init(&file->lexer, cpp->ctx, &srcfile->inbuf, srcfile->base);
+	file->filename = srcfile->filename;
+	file->replay = NULL;
+	file->recording = array_new(RECORDING_INIT_SIZE, sizeof(*file->recording));
+	file->skips = array_new(SKIPS_INIT_SIZE, sizeof(*file->skips));
 
 	return MCC_ERROR_OK;
 }
 
 /*
- * Free the given instance of `cpp_file'.
+ * Free the given instance of `cpp_file'. If the whole file was lexed, keep
+ * the recording of its tokens for later includes of the file.
  */
 void cpp_file_free(struct cpp *cpp, struct cpp_file *file)
 {
-	(void) cpp;
-	inbuf_close(&file->inbuf);
-	lexer_free(&file->lexer);
+	struct cpp_file_info *info = file->info;
+	struct token **recording = file->recording;
+
 	toklist_free(&file->tokens);
+
+	if (file->replay) {
+		if (file->lexing_skip)
+			lexer_free(&file->lexer);
+		return;
+	}
+
+	lexer_free(&file->lexer);
+
+	if (!info->tokens && array_size(recording) > 0
+		&& token_is_eof(array_last(recording))) {
+		info->tokens = recording;
+		info->skips = file->skips;
+		info->srcfile = file->srcfile;
+		array_push(cpp->recorded, info);
+	}
+	else {
+		array_delete(recording);
+		array_delete(file->skips);
+	}
 }
 
 /*
@@ -74,64 +174,246 @@ void cpp_file_include(struct cpp *cpp, struct cpp_file *file)
 	if (cpp->token && !token_is_eol(cpp->token))
 		toklist_insert_first(&cpp_this_file(cpp)->tokens, cpp->token);
 
+	cpp_mi_begin(cpp, file);
 	list_insert_head(&cpp->file_stack, &file->list_node);
 }
 
+struct cpp_search *cpp_search_new(void)
+{
+	struct cpp_search *search;
+
+	search = mcc_malloc(sizeof(*search));
+
+	search->include_dirs = array_new(4, sizeof(*search->include_dirs));
+	search->system_dirs = array_new(4, sizeof(*search->system_dirs));
+	objpool_init(&search->result_pool, sizeof(struct cpp_search_result),
+		RESULT_POOL_BLOCK_SIZE);
+	hashtab_init(&search->results, &search->result_pool, RESULTS_INIT_SIZE);
+	mempool_init(&search->data, SEARCH_DATA_BLOCK_SIZE);
+	pthread_mutex_init(&search->lock, NULL);
+
+	return search;
+}
+
+void cpp_search_delete(struct cpp_search *search)
+{
+	array_delete(search->include_dirs);
+	array_delete(search->system_dirs);
+	hashtab_free(&search->results);
+	objpool_free(&search->result_pool);
+	mempool_free(&search->data);
+	pthread_mutex_destroy(&search->lock);
+
+	free(search);
+}
+
 /*
- * Search the file @filename to be included in @search_dirs. Configure the
- * `cpp_file' instance accordingly and return success indicator.
+ * Add the directory @dir to the list of directories searched for included
+ * files, after the directory of the including file (for #include "file")
+ * and the directories added before. If @is_system is set, the directory is
+ * searched after all of the non-system ones, as with -isystem.
+ *
+ * The directories must be added before the first file is searched for,
+ * since the results of the searches are cached.
  */
-static mcc_error_t search_file(struct cpp *cpp, const char **search_dirs, char *filename,
-	struct cpp_file *file)
+void cpp_search_add_dir(struct cpp_search *search, char *dir, bool is_system)
 {
-	bool file_found;
-	struct strbuf pathbuf;
-	char *path;
-	size_t i;
-	mcc_error_t err;
+	assert(hashtab_count(&search->results) == 0);
+
+	dir = mempool_strdup(&search->data, dir);
+
+	if (is_system)
+		array_push(search->system_dirs, dir);
+	else
+		array_push(search->include_dirs, dir);
+}
 
-	(void) search_dirs; /* TODO use this */
+void cpp_add_include_dir(struct cpp *cpp, char *dir, bool is_system)
+{
+	cpp_search_add_dir(cpp->search, dir, is_system);
+}
+
+/*
+ * Try the path @dir/@filename (of which @dir has @dir_len characters) and
+ * return true if there's a file. Leave the path in @path.
+ */
+static bool try_path(struct strbuf *path, char *dir, size_t dir_len, char *filename)
+{
+	strbuf_reset(path);
+	strbuf_putn(path, dir, dir_len);
+	strbuf_putc(path, '/');
+	strbuf_printf(path, "%s", filename);
 
-	strbuf_init(&pathbuf, 128);
+	DEBUG_PRINTF("Testing: %s\n", strbuf_get_string(path));
 
-	file_found = false;
+	return access(strbuf_get_string(path), F_OK) == 0;
+}
+
+/*
+ * Search the file @filename to be included from the file @includer: in the
+ * directory of @includer if @quoted (#include "file"), then in the -I
+ * directories, then in the -isystem and default system directories. Return
+ * the path of the file in @path.
+ */
+static bool search_dirs(struct cpp_search *search, bool quoted, char *includer,
+	char *filename, struct strbuf *path)
+{
+	char *slash;
+	size_t i;
 
 	if (filename[0] == '/') {
-		file_found = (access(filename, F_OK) == 0);
-		path = filename;
-	} else {
-		for (i = 0; i < ARRAY_SIZE(include_dirs); i++) {
-			strbuf_reset(&pathbuf);
-			strbuf_printf(&pathbuf, "%s/%s", include_dirs[i], filename);
-
-			path = strbuf_get_string(&pathbuf);
-
-			DEBUG_PRINTF("Testing: %s\n", path);
-
-			if (access(path, F_OK) == 0) {
-				file_found = true;
-				break;
-			}
-		}
+		strbuf_reset(path);
+		strbuf_printf(path, "%s", filename);
+		return access(filename, F_OK) == 0;
+	}
+
+	if (quoted) {
+		slash = strrchr(includer, '/');
+		if (!slash && try_path(path, ".", 1, filename))
+			return true;
+		if (slash && try_path(path, includer, MAX(slash - includer, 1), filename))
+			return true;
+	}
+
+	for (i = 0; i < array_size(search->include_dirs); i++)
+		if (try_path(path, search->include_dirs[i], strlen(search->include_dirs[i]),
+			filename))
+			return true;
+
+	for (i = 0; i < array_size(search->system_dirs); i++)
+		if (try_path(path, search->system_dirs[i], strlen(search->system_dirs[i]),
+			filename))
+			return true;
+
+	for (i = 0; i < ARRAY_SIZE(default_system_dirs); i++)
+		if (try_path(path, default_system_dirs[i], strlen(default_system_dirs[i]), filename))
+			return true;
+
+	return false;
+}
+
+/*
+ * Return the result of the search for @filename, included from @includer,
+ * under the @key built by `lookup_file'. The results are cached in @search,
+ * so that each header is only searched for once, however many preprocessors
+ * share @search. The results are never modified once they're inserted.
+ */
+static struct cpp_search_result *search_lookup(struct cpp_search *search, struct strbuf *key,
+	bool quoted, char *includer, char *filename)
+{
+	struct cpp_search_result *result;
+	struct strbuf path;
+	char *canon;
+
+	pthread_mutex_lock(&search->lock);
+
+	result = hashtab_search(&search->results, strbuf_get_string(key), strbuf_strlen(key));
+	if (result)
+		goto out_unlock;
+
+	result = objpool_alloc(&search->result_pool);
+	result->path = NULL;
+	result->canon = NULL;
+
+	strbuf_init(&path, 128);
+	if (search_dirs(search, quoted, includer, filename, &path)) {
+		result->path = strbuf_copy_to_mempool(&path, &search->data);
+		canon = realpath(result->path, NULL);
+		result->canon = canon ? mempool_strdup(&search->data, canon) : result->path;
+		free(canon);
 	}
+	strbuf_free(&path);
 
-	if (!file_found)
+	hashtab_insert(&search->results, strbuf_get_string(key), strbuf_strlen(key),
+		&result->hashnode);
+
+out_unlock:
+	pthread_mutex_unlock(&search->lock);
+	return result;
+}
+
+/*
+ * Look the file @filename to be included up. The results of the lookups,
+ * negative ones included, are cached by the kind of the include, the
+ * directory of the including file (which only matters for #include "file")
+ * and @filename, first in this preprocessor, then in its `cpp_search'.
+ */
+static struct cpp_lookup *lookup_file(struct cpp *cpp, bool quoted, char *filename)
+{
+	struct cpp_lookup *lookup;
+	struct cpp_search_result *result;
+	struct strbuf key;
+	char *includer;
+	char *slash;
+
+	strbuf_init(&key, 128);
+	strbuf_putc(&key, quoted ? '"' : '<');
+
+	includer = cpp_this_file(cpp)->filename;
+	if (quoted && filename[0] != '/') {
+		slash = strrchr(includer, '/');
+		if (slash)
+			strbuf_putn(&key, includer, slash - includer + 1);
+	}
+
+	strbuf_putc(&key, '\0');
+	strbuf_printf(&key, "%s", filename);
+
+	lookup = hashtab_search(&cpp->lookups, strbuf_get_string(&key), strbuf_strlen(&key));
+	if (lookup)
+		goto out;
+
+	result = search_lookup(cpp->search, &key, quoted, includer, filename);
+
+	lookup = objpool_alloc(&cpp->lookup_pool);
+	lookup->path = result->path;
+	lookup->info = result->path ? get_info(cpp, result->canon) : NULL;
+
+	hashtab_insert(&cpp->lookups, strbuf_get_string(&key), strbuf_strlen(&key),
+		&lookup->hashnode);
+
+out:
+	strbuf_free(&key);
+	return lookup;
+}
+
+/*
+ * Search the file @filename to be included. Open it and return it in @file,
+ * or set @file to NULL if the file needn't be included again (see
+ * `cpp_file_is_skippable'). Return success indicator.
+ */
+static mcc_error_t search_file(struct cpp *cpp, bool quoted, char *filename,
+	struct cpp_file **file)
+{
+	struct cpp_lookup *lookup;
+	mcc_error_t err;
+
+	lookup = lookup_file(cpp, quoted, filename);
+	if (!lookup->path)
 		return MCC_ERROR_NOENT;
 
-	err = cpp_file_init(cpp, file, path); 
-	strbuf_free(&pathbuf);
+	if (cpp_file_is_skippable(lookup->info)) {
+		DEBUG_PRINTF("Skipping %s", lookup->path);
+		*file = NULL;
+		return MCC_ERROR_OK;
+	}
+
+	*file = objpool_alloc(&cpp->file_pool);
+	err = cpp_file_init(cpp, *file, lookup->path, lookup->info);
+	if (err != MCC_ERROR_OK)
+		objpool_dealloc(&cpp->file_pool, *file);
 
 	return err;
 }
 
-mcc_error_t cpp_file_include_qheader(struct cpp *cpp, char *filename, struct cpp_file *file)
+mcc_error_t cpp_file_include_qheader(struct cpp *cpp, char *filename, struct cpp_file **file)
 {
-	return search_file(cpp, include_dirs, filename, file);
+	return search_file(cpp, true, filename, file);
 }
 
-mcc_error_t cpp_file_include_hheader(struct cpp *cpp, char *filename, struct cpp_file *file)
+mcc_error_t cpp_file_include_hheader(struct cpp *cpp, char *filename, struct cpp_file **file)
 {
-	return search_file(cpp, include_dirs, filename, file);
+	return search_file(cpp, false, filename, file);
 }
 
 mcc_error_t cpp_open_file(struct cpp *cpp, char *filename)
@@ -141,7 +423,8 @@ mcc_error_t cpp_open_file(struct cpp *cpp, char *filename)
 
 	file = objpool_alloc(&cpp->file_pool);
 
-	if ((err = cpp_file_init(cpp, file, filename)) != MCC_ERROR_OK) {
+	err = cpp_file_init(cpp, file, filename, cpp_file_get_info(cpp, filename));
+	if (err != MCC_ERROR_OK) {
 		objpool_dealloc(&cpp->file_pool, file);
 		return err;
 	}
@@ -161,6 +444,8 @@ void cpp_close_file(struct cpp *cpp)
 	file = list_first(&cpp->file_stack);
 	list_remove_head(&cpp->file_stack);
 
+	cpp_mi_end(cpp, file);
+
 	cpp_file_free(cpp, file);
 	objpool_dealloc(&cpp->file_pool, file);
 }
@@ -1,3 +1,4 @@
+#include "array.h"
 #include "context.h"
 #include "cpp-internal.h"
 #include "inbuf.h"
@@ -5,6 +6,7 @@
 #include "print.h"
 #include "strbuf.h"
 #include "toklist.h"
+#include <string.h>
 #include <time.h>
 
 void macro_init(struct macro *macro)
@@ -12,7 +14,8 @@ void macro_init(struct macro *macro)
 	macro->name = NULL;
 	toklist_init(&macro->args);
 	toklist_init(&macro->expansion);
-	macro->is_expanding = false;
+	macro->ops = NULL;
+	macro->expand_args = NULL;
 	macro->flags = 0;
 }
 
@@ -20,6 +23,143 @@ void macro_free(struct macro *macro)
 {
 	toklist_free(&macro->args);
 	toklist_free(&macro->expansion);
+	if (macro->ops)
+		array_delete(macro->ops);
+	free(macro->expand_args);
+}
+
+/*
+ * Return the index of the parameter of @macro which @token names, or -1 if
+ * it doesn't name any.
+ */
+static int macro_param_index(struct macro *macro, struct token *token)
+{
+	size_t i;
+
+	if (!token_is(token, TOKEN_NAME))
+		return -1;
+
+	for (i = 0; i < toklist_length(&macro->args); i++)
+		if (toklist_at(&macro->args, i)->symbol == token->symbol)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Append an instruction to the program of @macro.
+ */
+static void macro_emit(struct macro *macro, enum macro_opcode opcode, size_t index)
+{
+	struct macro_op *op;
+
+	/* extend the run of literal tokens if possible */
+	if (opcode == MACRO_OP_TOKENS && array_size(macro->ops) > 0) {
+		op = &array_last(macro->ops);
+		if (op->opcode == MACRO_OP_TOKENS && op->index + op->count == index) {
+			op->count++;
+			return;
+		}
+	}
+
+	op = array_push_new(macro->ops);
+	op->opcode = opcode;
+	op->index = index;
+	op->count = 1;
+	op->rhs_arg = -1;
+	op->rhs_stringify = false;
+}
+
+/*
+ * Return the number of tokens of the operand which starts at index @i of
+ * the replacement list of @macro: 2 for # followed by a parameter, 1 for
+ * any other token.
+ */
+static size_t macro_operand_len(struct macro *macro, size_t i)
+{
+	struct token *next = toklist_at(&macro->expansion, i + 1);
+
+	/* # is only an operator if a parameter follows */
+	if (token_is(toklist_at(&macro->expansion, i), TOKEN_HASH) && next
+		&& macro_param_index(macro, next) >= 0)
+		return 2;
+
+	return 1;
+}
+
+/*
+ * Is there a ## operator at index @i of the replacement list of @macro?
+ */
+static bool macro_is_paste(struct macro *macro, size_t i)
+{
+	struct token *token = toklist_at(&macro->expansion, i);
+
+	return token && token_is(token, TOKEN_HASH_HASH) && toklist_at(&macro->expansion, i + 1);
+}
+
+/*
+ * Compile the replacement list of @macro into a program, a sequence of
+ * instructions (see `enum macro_opcode') which `macro_replace_args' runs
+ * on each invocation. Parameters are resolved to argument numbers here, so
+ * that the invocation doesn't have to look them up.
+ *
+ * This also finds out which parameters are replaced by the complete macro
+ * expansion of their arguments, rather than being operands of # or ##. Only
+ * those arguments are expanded when the macro is invoked.
+ */
+void macro_compile(struct macro *macro)
+{
+	struct token *token;
+	struct macro_op *op;
+	size_t num_args = toklist_length(&macro->args);
+	size_t i = 0;
+	size_t len;
+	int param;
+
+	macro->ops = array_new(4, sizeof(*macro->ops));
+	macro->expand_args = mcc_malloc(MAX(num_args, 1) * sizeof(*macro->expand_args));
+	memset(macro->expand_args, 0, num_args * sizeof(*macro->expand_args));
+
+	while ((token = toklist_at(&macro->expansion, i)) != NULL) {
+		len = macro_operand_len(macro, i);
+		param = macro_param_index(macro, toklist_at(&macro->expansion, i + len - 1));
+
+		if (!macro_is_paste(macro, i + len)) {
+			if (len == 2) {
+				macro_emit(macro, MACRO_OP_STRINGIFY, param);
+			}
+			else if (param >= 0) {
+				macro_emit(macro, MACRO_OP_ARG, param);
+				macro->expand_args[param] = true;
+			}
+			else {
+				macro_emit(macro, MACRO_OP_TOKENS, i);
+			}
+
+			i += len;
+			continue;
+		}
+
+		/* the left operand of ## */
+		if (len == 2)
+			macro_emit(macro, MACRO_OP_STRINGIFY, param);
+		else if (param >= 0)
+			macro_emit(macro, MACRO_OP_PASTE_ARG, param);
+		else
+			macro_emit(macro, MACRO_OP_TOKENS, i);
+
+		i += len;
+
+		/* each `## operand' which follows is pasted to the result so far */
+		while (macro_is_paste(macro, i)) {
+			len = macro_operand_len(macro, i + 1);
+			macro_emit(macro, MACRO_OP_PASTE, i + len);
+			op = &array_last(macro->ops);
+			op->rhs_arg = macro_param_index(macro, toklist_at(&macro->expansion, i + len));
+			op->rhs_stringify = (len == 2);
+			i += 1 + len;
+		}
+	}
 }
 
 bool macro_is_funclike(struct macro *macro)
@@ -27,18 +167,20 @@ bool macro_is_funclike(struct macro *macro)
 	return macro->flags & MACRO_FLAGS_FUNCLIKE;
 }
 
-static bool token_is_expandable_macro(struct token *token)
+/*
+ * Is @token an invocation of a macro which should be expanded? @next is
+ * the token which follows @token (or NULL).
+ */
+static bool token_is_expandable_macro(struct token *token, struct token *next)
 {
 	struct macro *macro;
-	struct token *peek;
 
 	if (!token_is_macro(token) || token->noexpand)
 		return false;
 
 	macro = &token->symbol->def->macro;
 
-	peek = toklist_next(token);
-	if (macro_is_funclike(macro) && (!peek || !token_is(peek, TOKEN_LPAREN)))
+	if (macro_is_funclike(macro) && (!next || !token_is(next, TOKEN_LPAREN)))
 		return false;
 
 	return true;
@@ -111,7 +253,8 @@ static void setup_builtin_static(struct cpp *cpp, char *name, char *fmt, ...)
 	def->type = SYMBOL_TYPE_CPP_MACRO;
 	macro_init(&def->macro);
 	def->macro.flags = MACRO_FLAGS_BUILTIN;
-	toklist_load_from_strbuf(&def->macro.expansion, cpp->ctx, &str);
+	toklist_load_from_strbuf(&def->macro.expansion, cpp->ctx, NULL, &str);
+	macro_compile(&def->macro);
 
 	strbuf_free(&str);
 }
@@ -122,17 +265,26 @@ static void setup_builtin_static(struct cpp *cpp, char *name, char *fmt, ...)
 static void cpp_builtin_file(struct cpp *cpp, struct macro *macro, struct toklist *out)
 {
 	(void) macro;
-	toklist_load_from_string(out, cpp->ctx, "\"%s\"", cpp_this_file(cpp)->filename);
+	toklist_load_from_string(out, cpp->ctx, &cpp->scratch, "\"%s\"",
+		cpp_this_file(cpp)->filename);
 }
 
 /*
  * Expand __LINE__ to the number of currently processed line (where the current
- * file's lexer operates).
+ * file's lexer operates). That's the physical line on which the logical line
+ * starts.
  */
 static void cpp_builtin_line(struct cpp *cpp, struct macro *macro, struct toklist *out)
 {
+	struct location location;
+	uint32_t line_no = 0;
+
 	(void) macro;
-	toklist_load_from_string(out, cpp->ctx, "%lu", cpp_this_file(cpp)->lexer.location.line_no);
+
+	if (srcmgr_decode(&cpp->ctx->srcmgr, cpp_this_file(cpp)->line_loc, &location))
+		line_no = location.line_no;
+
+	toklist_load_from_string(out, cpp->ctx, &cpp->scratch, "%" PRIu32, line_no);
 }
 
 /*
@@ -149,7 +301,7 @@ static void cpp_builtin_time(struct cpp *cpp, struct macro *macro, struct toklis
 	time(&rawtime);
 	timeinfo = localtime(&rawtime);
 	strftime(timestr, sizeof(timestr), "%T", timeinfo);
-	toklist_load_from_string(out, cpp->ctx, "\"%s\"", timestr);
+	toklist_load_from_string(out, cpp->ctx, &cpp->scratch, "\"%s\"", timestr);
 }
 
 /*
@@ -168,7 +320,7 @@ static void cpp_builtin_date(struct cpp *cpp, struct macro *macro, struct toklis
 	time(&rawtime);
 	timeinfo = localtime(&rawtime);
 	strftime(datestr, sizeof(datestr), "%b %e %Y", timeinfo);
-	toklist_load_from_string(out, cpp->ctx, "\"%s\"", datestr);
+	toklist_load_from_string(out, cpp->ctx, &cpp->scratch, "\"%s\"", datestr);
 }
 
 /*
@@ -193,20 +345,17 @@ void cpp_setup_builtin_macros(struct cpp *cpp)
  * See 6.10.3.2 The # operator, par. 2.
  * TODO Work correctly with the lstrs.
  */
-static struct token *cpp_stringify(struct cpp *cpp, struct token *token)
+static struct token *cpp_stringify(struct cpp *cpp, struct toklist *repl_list)
 {
 	struct strbuf str;
-	struct toklist *repl_list;
 	struct token *first;
 	struct token *last;
 	struct token *result;
 
-	assert(token_is_macro_arg(token));
-	repl_list = &token->symbol->def->macro_arg.tokens;
-
 	strbuf_init(&str, 128);
+	strbuf_putc(&str, '\"');
 	toklist_foreach(t, repl_list) {
-		if (t->after_white && t != toklist_first(repl_list))
+		if (t->after_white && t_it != toklist_begin(repl_list))
 			strbuf_putc(&str, ' ');
 
 		switch (t->type) {
@@ -219,19 +368,27 @@ static struct token *cpp_stringify(struct cpp *cpp, struct token *token)
 			strbuf_printf(&str, token_get_spelling(t));
 		}
 	}
+	strbuf_putc(&str, '\"');
 
-	result = objpool_alloc(&cpp->ctx->token_pool);
+	/* the spelling is needed when the result is an operand of ## */
+	result = cpp_scratch_token(cpp);
 	result->type = TOKEN_STRING_LITERAL;
-	result->lstr.str = strbuf_copy_to_mempool(&str, &cpp->ctx->token_data);
-	result->lstr.len = strbuf_strlen(&str);
+	result->spelling = strbuf_copy_to_mempool(&str, &cpp->scratch);
+	result->lstr = mempool_alloc(&cpp->scratch, sizeof(*result->lstr));
+	result->lstr->len = strbuf_strlen(&str) - 2;
+	result->lstr->str = mempool_strndup(&cpp->scratch, result->spelling + 1,
+		result->lstr->len);
+	result->loc = SRCLOC_NONE;
+	result->is_at_bol = false;
+	result->after_white = false;
 	result->noexpand = false;
+	result->is_scratch = true;
 
 	first = toklist_first(repl_list);
 	last = toklist_last(repl_list);
 
 	if (first && last) {
-		result->startloc = first->startloc;
-		result->endloc = last->endloc;
+		result->loc = first->loc;
 		result->is_at_bol = first->is_at_bol;
 		result->after_white = first->after_white;
 	}
@@ -250,72 +407,70 @@ static struct token *new_placemarker(struct cpp *cpp)
 {
 	struct token *token;
 
-	token = objpool_alloc(&cpp->ctx->token_pool);
+	token = cpp_scratch_token(cpp);
 	token->type = TOKEN_PLACEMARKER;
+	token->is_scratch = true;
 
 	return token;
 }
 
 /*
- * Prepare token for pasting. If the token is a macro parameter, copy its
- * replacement list into the output list and if the resulting list is empty,
- * insert a placemarker.
- *
- * If the token is not a macro parameter, just insert it to the output.
+ * Put the right operand of the ## instruction @op into @lst: the stringified
+ * argument, the tokens of the argument (or a placemarker if there are none),
+ * or the token of the replacement list of @macro.
  */
-static void paste_prepare(struct cpp *cpp, struct token *arg, struct toklist *lst)
+static void paste_operand(struct cpp *cpp, struct macro *macro, struct macro_op *op,
+	struct macro_arg *args, struct toklist *lst)
 {
-	if (token_is_macro_arg(arg)) {
-		toklist_copy(cpp->ctx, &arg->symbol->def->macro_arg.tokens, lst);
+	if (op->rhs_stringify) {
+		toklist_insert(lst, cpp_stringify(cpp, &args[op->rhs_arg].tokens));
+	}
+	else if (op->rhs_arg >= 0) {
+		toklist_extend(lst, &args[op->rhs_arg].tokens);
 
 		if (toklist_is_empty(lst))
 			toklist_insert(lst, new_placemarker(cpp));
-	} else {
-		toklist_insert(lst, arg);
+	}
+	else {
+		toklist_insert(lst, toklist_at(&macro->expansion, op->index));
 	}
 }
 
 /*
- * This function ``pastes'' two tokens. It does so by taking the spellings of
- * those tokens, concatenating them and then feeding the result back to the lexer.
- * The lexing of the concatenation should produce a single valid preprocessing token.
+ * This function ``pastes'' the last token of @out and the first token of @rhs.
+ * It does so by taking the spellings of those tokens, concatenating them and
+ * then feeding the result back to the lexer. The lexing of the concatenation
+ * should produce a single valid preprocessing token. The rest of @rhs is then
+ * appended to @out.
  *
  * See TODO.
  */
-static void paste(struct cpp *cpp, struct token *t, struct token *u, struct toklist *out)
+static void paste(struct cpp *cpp, struct toklist *out, struct toklist *rhs)
 {
 	struct strbuf buf;
-	struct toklist lst_t1;
-	struct toklist lst_t2;
 	struct token *a;
 	struct token *b;
 	struct toklist paste_result;
 
-	toklist_init(&lst_t1);
-	toklist_init(&lst_t2);
 	toklist_init(&paste_result);
-	toklist_init(out);
-
-	paste_prepare(cpp, t, &lst_t1);
-	assert(!toklist_is_empty(&lst_t1));
-
-	paste_prepare(cpp, u, &lst_t2);
-	assert(!toklist_is_empty(&lst_t2));
 
-	a = toklist_remove_last(&lst_t1);
-	b = toklist_remove_first(&lst_t2);
+	a = toklist_remove_last(out);
+	b = toklist_remove_first(rhs);
+	assert(a != NULL && b != NULL);
 
 	if (token_is(a, TOKEN_PLACEMARKER)) {
-		toklist_insert_first(&paste_result, b);
+		toklist_insert(&paste_result, b);
 	} else if (token_is(b, TOKEN_PLACEMARKER)) {
-		toklist_insert_first(&paste_result, a);
+		toklist_insert(&paste_result, a);
 	} else {
 		strbuf_init(&buf, 32);
 		strbuf_printf(&buf, "%s%s", token_get_spelling(a), token_get_spelling(b));
 
 		DEBUG_EXPR("%s", strbuf_get_string(&buf));
 
-		toklist_load_from_strbuf(&paste_result, cpp->ctx, &buf);
+		toklist_load_from_strbuf(&paste_result, cpp->ctx, &cpp->scratch, &buf);
+		toklist_foreach(token, &paste_result)
+			token->loc = a->loc;
 		if (toklist_length(&paste_result) != 1)
 			cpp_error(cpp, "pasting `%s' and `%s' does not yield a single preprocessing token",
 				token_get_spelling(a), token_get_spelling(b));
@@ -323,50 +478,49 @@ static void paste(struct cpp *cpp, struct token *t, struct token *u, struct tokl
 		strbuf_free(&buf);
 	}
 
-	toklist_append(out, &lst_t1);
 	toklist_append(out, &paste_result);
-	toklist_append(out, &lst_t2);
+	toklist_append(out, rhs);
+
+	toklist_free(&paste_result);
 }
 
 /******************************** macro expansion ********************************/
 
-static struct token *macro_expand_internal(struct cpp *cpp, struct toklist *in, struct toklist *out);
+static size_t macro_expand_internal(struct cpp *cpp, struct toklist *in, struct toklist *out);
 static void macro_expand_rescan(struct cpp *cpp, struct toklist *in, struct toklist *out);
 
 /*
- * Identify and recursively expand arguments of macro invocation.
+ * Identify the arguments of the macro invocation and push them onto the
+ * argument stack `cpp->args', in the order of the parameters. Recursively
+ * expand those whose expansion is used. Return the number of tokens of the
+ * invocation, including the macro name and the closing parenthesis. If the
+ * closing parenthesis is missing, report it and take all of @invocation.
+ *
+ * The recursive expansions push arguments of their own (and may move the
+ * stack), so each argument is only pushed once it's complete.
  */
-static struct token *macro_parse_args(struct cpp *cpp, struct macro *macro, struct toklist *invocation)
+static size_t macro_parse_args(struct cpp *cpp, struct macro *macro, struct toklist *invocation)
 {
 	struct token *token;
-	struct token *next;
-	struct symdef *def;
-	struct toklist args;
+	struct macro_arg arg;
+	struct toklist tmp;
 	int parens_balance = 0;
+	size_t param_index = 0;
+	size_t i;
 
-	token = toklist_first(invocation);
-	assert(token_is_expandable_macro(token));
-
-	token = toklist_next(token);
-	assert(token_is(token, TOKEN_LPAREN));
+	assert(token_is_expandable_macro(toklist_at(invocation, 0), toklist_at(invocation, 1)));
+	assert(token_is(toklist_at(invocation, 1), TOKEN_LPAREN));
 
-	token = toklist_next(token);
+	i = 2;
 
 	/*
 	 * The `macro->args' list is the list of TOKEN_NAME tokens which are
 	 * the formal parameters of the macro.
 	 */
 	toklist_foreach(param, &macro->args) {
-		/*
-		 * Define the symbol corresponding to the formal parameter to
-		 * be a CPP macro argument.
-		 */
-		def = symbol_define(&cpp->ctx->symtab, param->symbol);
-		def->type = SYMBOL_TYPE_UNDEF;
-		toklist_init(&def->macro_arg.tokens);
+		toklist_init(&arg.tokens);
 
-		toklist_init(&args);
-		while (token) {
+		while ((token = toklist_at(invocation, i)) != NULL) {
 			if (token_is(token, TOKEN_LPAREN)) {
 				parens_balance++;
 			} else if (token_is(token, TOKEN_RPAREN)) {
@@ -376,131 +530,178 @@ static struct token *macro_parse_args(struct cpp *cpp, struct macro *macro, stru
 					break;
 			} else if (token_is(token, TOKEN_COMMA) && parens_balance == 0) {
 				if (param->type != TOKEN_ELLIPSIS) {
-					token = toklist_next(token); /* `,' */
+					i++; /* `,' */
 					break;
 				}
 			}
 
 			assert(parens_balance >= 0);
 
-			next = toklist_next(token);
-			toklist_remove(invocation, token); /* TODO make this cleaner */
-			toklist_insert(&args, token);
-			token = next;
+			toklist_insert(&arg.tokens, token);
+			i++;
 		}
 
-		/* TODO refactor the rest of this block */
-
 		/*
-		 * Copy the accumulated arguments in `args' to the argument's
-		 * definition.
-		 *
-		 * Expand the arguments recursively.
+		 * Expand the arguments recursively, unless the expansion is
+		 * never used (see `macro_compile'). The rescan consumes its
+		 * input, so it gets a list of its own.
 		 */
-		toklist_copy(cpp->ctx, &args, &def->macro_arg.tokens);
-		toklist_init(&def->macro_arg.expansion);
-		macro_expand_rescan(cpp, &args, &def->macro_arg.expansion);
+		toklist_init(&arg.expansion);
+		if (macro->expand_args[param_index]) {
+			toklist_init(&tmp);
+			toklist_extend(&tmp, &arg.tokens);
+			macro_expand_rescan(cpp, &tmp, &arg.expansion);
+			toklist_free(&tmp);
+		}
 
-		/*
-		 * NOTE: Set only after the expansion of the arguments too place.
-		 */
-		def->type = SYMBOL_TYPE_CPP_MACRO_ARG;
+		array_push(cpp->args, arg);
+		param_index++;
 	}
 
-	/* TODO Error checking */
-	return token;
+	/* TODO Check the number of arguments */
+	if (i < toklist_length(invocation))
+		return i + 1; /* `)' */
+
+	cpp_error_at(cpp, toklist_first(invocation)->loc,
+		"unterminated argument list invoking macro `%s'",
+		symbol_get_name(toklist_first(invocation)->symbol));
+
+	return toklist_length(invocation);
+}
+
+/*
+ * Pop the arguments above @base off the argument stack and free them.
+ */
+static void macro_free_args(struct cpp *cpp, size_t base)
+{
+	struct macro_arg arg;
+
+	while (array_size(cpp->args) > base) {
+		arg = array_pop(cpp->args);
+		toklist_free(&arg.tokens);
+		toklist_free(&arg.expansion);
+	}
+}
+
+/*
+ * Is @macro being expanded? Macros aren't expanded again within their own
+ * expansion (see 6.10.3.4 Rescanning and further replacement, par. 2). The
+ * nesting is seldom deeper than a few levels, so the stack is just searched.
+ */
+static bool macro_is_expanding(struct cpp *cpp, struct macro *macro)
+{
+	size_t i;
+
+	for (i = array_size(cpp->expanding); i > 0; i--)
+		if (cpp->expanding[i - 1] == macro)
+			return true;
+
+	return false;
+}
+
+/*
+ * Return a copy of @token which won't be expanded anymore. Tokens are shared
+ * by the replacement lists of macros and all their expansions, so they have
+ * to be copied before they're changed.
+ */
+static struct token *token_copy_noexpand(struct cpp *cpp, struct token *token)
+{
+	struct token *copy;
+
+	copy = cpp_scratch_token(cpp);
+	*copy = *token;
+	copy->noexpand = true;
+	copy->is_scratch = true;
+
+	return copy;
 }
 
 static void macro_expand_rescan(struct cpp *cpp, struct toklist *in, struct toklist *out)
 {
 	struct token *token;
-	struct token *end;
 	struct toklist expansion;
 
-	token = toklist_first(in);
-
-	while (token) {
-		if (!token_is_expandable_macro(token)) {
-			toklist_insert(out, toklist_remove_first(in));
-		} else if (token->symbol->def->macro.is_expanding) {
-			token->noexpand = true;
+	while ((token = toklist_first(in)) != NULL) {
+		if (!token_is_expandable_macro(token, toklist_at(in, 1))) {
 			toklist_insert(out, toklist_remove_first(in));
+		} else if (macro_is_expanding(cpp, &token->symbol->def->macro)) {
+			toklist_insert(out, token_copy_noexpand(cpp, toklist_remove_first(in)));
 		} else {
 			toklist_init(&expansion);
-			end = macro_expand_internal(cpp, in, &expansion);
-			toklist_remove_range(in, token, end);
+			toklist_remove_first_n(in, macro_expand_internal(cpp, in, &expansion));
 			toklist_append(out, &expansion);
+			toklist_free(&expansion);
 		}
-
-		token = toklist_first(in);
 	}
 }
 
-static void macro_replace_args(struct cpp *cpp, struct toklist *in, struct toklist *out)
+/*
+ * Run the program of @macro (see `macro_compile') with the arguments @args
+ * and append the result to @out.
+ */
+static void macro_replace_args(struct cpp *cpp, struct macro *macro, struct macro_arg *args,
+	struct toklist *out)
 {
-	struct token *token;
-	struct token *next;
-	struct token *arg1;
-	struct token *arg2;
-	struct toklist paste_result;
-	bool hash = false;
+	struct toklist *list = &macro->expansion;
+	struct toklist rhs;
+	struct macro_op *op;
+	size_t i;
 
-	while ((token = toklist_first(in)) != NULL) {
-		next = toklist_next(token);
+	for (i = 0; i < array_size(macro->ops); i++) {
+		op = &macro->ops[i];
 
-		if (next && token_is(next, TOKEN_HASH_HASH)) {
-			toklist_remove(in, next); /* remove ## */
-			next = toklist_next(token); /* second arg */
+		switch (op->opcode) {
+		case MACRO_OP_TOKENS:
+			toklist_extend_range(out, list, op->index, op->count);
+			break;
+
+		case MACRO_OP_ARG:
+			toklist_extend(out, &args[op->index].expansion);
+			break;
 
-			arg1 = token;
-			arg2 = next;
+		case MACRO_OP_STRINGIFY:
+			toklist_insert(out, cpp_stringify(cpp, &args[op->index].tokens));
+			break;
 
-			toklist_remove(in, arg1);
-			toklist_remove(in, arg2);
+		case MACRO_OP_PASTE_ARG:
+			toklist_extend(out, &args[op->index].tokens);
+			if (toklist_is_empty(&args[op->index].tokens))
+				toklist_insert(out, new_placemarker(cpp));
+			break;
 
-			assert(arg2 != NULL);
+		case MACRO_OP_PASTE:
+			toklist_init(&rhs);
+			paste_operand(cpp, macro, op, args, &rhs);
+			paste(cpp, out, &rhs);
+			toklist_free(&rhs);
 
-			paste(cpp, arg1, arg2, &paste_result);
-			toklist_append(out, &paste_result);
-		}
-		else if (token_is(token, TOKEN_HASH)) {
-			assert(!hash); /* Not # after # TODO Error reporting */
-			hash = true;
-			toklist_remove_first(in);
-		}
-		else if (!token_is_macro_arg(token)) {
-			assert(!hash); /* Not # {notarg} TODO Error reporting */
-			toklist_insert(out, toklist_remove_first(in));
-		}
-		else if (hash) {
-			toklist_insert(out, cpp_stringify(cpp, token));
-			toklist_remove_first(in);
-			hash = false;
-		}
-		else {
-			toklist_copy(cpp->ctx, &token->symbol->def->macro_arg.expansion, out);
-			toklist_remove_first(in);
+			/* a placemarker is only kept until the last ## of a chain */
+			if (token_is(toklist_last(out), TOKEN_PLACEMARKER)
+				&& (i + 1 == array_size(macro->ops) || op[1].opcode != MACRO_OP_PASTE))
+				toklist_remove_last(out);
+			break;
 		}
 	}
 }
 
-static struct token *macro_expand_internal(struct cpp *cpp, struct toklist *in, struct toklist *out)
+/*
+ * Expand the macro invocation at the start of @in into @out. Return the
+ * number of tokens of @in which the invocation consists of.
+ */
+static size_t macro_expand_internal(struct cpp *cpp, struct toklist *in, struct toklist *out)
 {
 	struct macro *macro;
 	struct token *token;
-	struct token *end;
-	struct toklist expansion;
+	size_t base;
+	size_t len;
 	struct toklist replaced_args;
 
 	token = toklist_first(in);
 
-	assert(token_is_expandable_macro(token));
+	assert(token_is_expandable_macro(token, toklist_at(in, 1)));
 	macro = &token->symbol->def->macro;
 
-	toklist_init(&expansion);
-	toklist_init(&replaced_args);
-
-	assert(!macro->is_expanding);
+	assert(!macro_is_expanding(cpp, macro));
 
 	if (macro->flags & MACRO_FLAGS_HANDLED) {
 		/*
@@ -511,35 +712,36 @@ static struct token *macro_expand_internal(struct cpp *cpp, struct toklist *in,
 		assert(!macro_is_funclike(macro));
 
 		macro->handler(cpp, macro, out);
-		return token;
+		return 1;
 	}
 
-	symtab_scope_begin(&cpp->ctx->symtab);
+	toklist_init(&replaced_args);
+
+	base = array_size(cpp->args);
 
 	if (macro_is_funclike(macro))
-		end = macro_parse_args(cpp, macro, in);
+		len = macro_parse_args(cpp, macro, in);
 	else
-		end = token;
+		len = 1;
 
-	toklist_copy(cpp->ctx, &macro->expansion, &expansion);
-	macro_replace_args(cpp, &expansion, &replaced_args);
-
-	toklist_foreach(token, &replaced_args) {
-		if (token->type == TOKEN_PLACEMARKER)
-			toklist_remove(&replaced_args, token);
-		assert(!token_is_eol(token));
-	}
+	/*
+	 * The replacement list is only read, the tokens which aren't
+	 * parameters end up in the expansion as they are.
+	 */
+	macro_replace_args(cpp, macro, &cpp->args[base], &replaced_args);
 
 	/*
-	 * NOTE: symtab scope ended prior to recursive expansion.
+	 * NOTE: the arguments are freed prior to recursive expansion.
 	 */
-	symtab_scope_end(&cpp->ctx->symtab);
+	macro_free_args(cpp, base);
 
-	macro->is_expanding = true;
+	array_push(cpp->expanding, macro);
 	macro_expand_rescan(cpp, &replaced_args, out);
-	macro->is_expanding = false;
+	(void) array_pop(cpp->expanding);
 
-	return end;
+	toklist_free(&replaced_args);
+
+	return len;
 }
 
 /******************************** public API ********************************/
@@ -548,3 +750,12 @@ void macro_expand(struct cpp *cpp, struct toklist *in, struct toklist *out)
 {
 	macro_expand_internal(cpp, in, out);
 }
+
+/*
+ * Completely macro-expand the tokens of @in (e.g. of an #if expression)
+ * into @out. The tokens are removed from @in.
+ */
+void macro_expand_list(struct cpp *cpp, struct toklist *in, struct toklist *out)
+{
+	macro_expand_rescan(cpp, in, out);
+}
@@ -1,18 +1,25 @@
 /*
  * TODO add #pragma and #line support
- * TODO cexpr support in if conditionals
  */
 
+#include "array.h"
 #include "context.h"
 #include "cpp-internal.h"
+#include "cpp.h"
 #include "debug.h"
 #include "inbuf.h"
+#include "intern.h"
 #include "lexer.h"
 #include <assert.h>
+#include <stdalign.h>
 
 #define FILE_POOL_BLOCK_SIZE	16
 #define MACRO_POOL_BLOCK_SIZE	32
+#define FILE_INFOS_INIT_SIZE	64
+#define LOOKUP_POOL_BLOCK_SIZE	64
+#define FILENAMES_BLOCK_SIZE	1024
 #define TOKEN_DATA_BLOCK_SIZE	1024
+#define SCRATCH_BLOCK_SIZE	4096
 
 static void cpp_requeue_current(struct cpp *cpp)
 {
@@ -25,18 +32,76 @@ static void cpp_setup_symtab(struct cpp *cpp)
 	cpp_setup_builtin_macros(cpp);
 }
 
+/*
+ * Get the next token of @file, whose recorded tokens are being replayed.
+ * The gaps in the recording (see `struct cpp_skip') are skipped again,
+ * unless the lines aren't to be skipped this time, in which case they're
+ * lexed now.
+ */
+static void replay_next(struct cpp *cpp, struct cpp_file *file)
+{
+	struct cpp_file_info *info = file->info;
+	struct cpp_skip *skip;
+
+	if (file->lexing_skip) {
+		cpp->token = objpool_alloc(&cpp->ctx->token_pool);
+		lexer_next(&file->lexer, cpp->token);
+		if (!token_is_eof(cpp->token)) {
+			file->line_loc = file->lexer.line_loc;
+			return;
+		}
+
+		objpool_dealloc(&cpp->ctx->token_pool, cpp->token);
+		lexer_free(&file->lexer);
+		file->lexing_skip = false;
+	}
+	else if (file->skip_pos < array_size(info->skips)
+		&& info->skips[file->skip_pos].pos == file->replay_pos) {
+		skip = &info->skips[file->skip_pos++];
+		if (!cpp_is_skip_mode(cpp)) {
+			/* the lexer stops at the end of the gap */
+			inbuf_open_mem(&file->skip_inbuf, info->srcfile->inbuf.data, skip->end);
+			file->skip_inbuf.offset = skip->start;
+			lexer_init(&file->lexer, cpp->ctx, &file->skip_inbuf, info->srcfile->base);
+			file->lexing_skip = true;
+			replay_next(cpp, file);
+			return;
+		}
+	}
+
+	/* the last token is TOKEN_EOF, which is never consumed */
+	cpp->token = file->replay[file->replay_pos];
+	if (file->replay_pos + 1 < array_size(file->replay))
+		file->replay_pos++;
+	file->line_loc = cpp->token->loc;
+}
+
 void move_next(struct cpp *cpp)
 {
 	struct cpp_file *this_file = cpp_this_file(cpp);
 
 	if (!toklist_is_empty(&this_file->tokens)) {
 		cpp->token = toklist_remove_first(&this_file->tokens);
+	} else if (this_file->replay) {
+		replay_next(cpp, this_file);
 	} else {
 		cpp->token = objpool_alloc(&cpp->ctx->token_pool);
 		lexer_next(&this_file->lexer, cpp->token);
+		this_file->line_loc = this_file->lexer.line_loc;
+		array_push(this_file->recording, cpp->token);
 	}
 }
 
+/*
+ * Allocate a token which is only needed until the expansion it's a part of
+ * is consumed, see `cpp_next'. The caller sets `is_scratch' once the token
+ * is filled in.
+ */
+struct token *cpp_scratch_token(struct cpp *cpp)
+{
+	return mempool_alloc_aligned(&cpp->scratch, sizeof(struct token), alignof(struct token));
+}
+
 struct token *cpp_peek(struct cpp *cpp)
 {
 	struct token *current;
@@ -51,22 +116,19 @@ struct token *cpp_peek(struct cpp *cpp)
 	return next;
 }
 
-static void cpp_error_internal(struct cpp *cpp, enum error_level level, char *fmt, va_list args)
+static void cpp_error_internal(struct cpp *cpp, enum error_level level, srcloc_t loc,
+	char *fmt, va_list args)
 {
 	struct strbuf msg;
-	struct cpp_file *file;
 
 	strbuf_init(&msg, 64);
-	file = cpp_this_file(cpp);
 
 	strbuf_vprintf_at(&msg, 0, fmt, args);
 	errlist_insert(&cpp->ctx->errlist,
 		level,
-		"some-file.c",
+		loc,
 		strbuf_get_string(&msg),
-		strbuf_get_string(&file->lexer.linebuf),
-		strbuf_strlen(&file->lexer.linebuf) + 1, // TODO
-		cpp->token->startloc);
+		true);
 
 	strbuf_free(&msg);
 }
@@ -75,7 +137,7 @@ static void cpp_error_internal(struct cpp *cpp, enum error_level level, char *fm
 //{
 //	va_list args;
 //	va_start(args, fmt);
-//	cpp_error_internal(cpp, ERROR_LEVEL_NOTICE, fmt, args);
+//	cpp_error_internal(cpp, ERROR_LEVEL_NOTICE, cpp->token->loc, fmt, args);
 //	va_end(args);
 //}
 
@@ -83,7 +145,7 @@ void cpp_warn(struct cpp *cpp, char *fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	cpp_error_internal(cpp, ERROR_LEVEL_WARNING, fmt, args);
+	cpp_error_internal(cpp, ERROR_LEVEL_WARNING, cpp->token->loc, fmt, args);
 	va_end(args);
 }
 
@@ -91,7 +153,29 @@ void cpp_error(struct cpp *cpp, char *fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	cpp_error_internal(cpp, ERROR_LEVEL_ERROR, fmt, args);
+	cpp_error_internal(cpp, ERROR_LEVEL_ERROR, cpp->token->loc, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Issue an error at @loc rather than at the current token.
+ */
+void cpp_error_at(struct cpp *cpp, srcloc_t loc, char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	cpp_error_internal(cpp, ERROR_LEVEL_ERROR, loc, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Issue a warning at @loc rather than at the current token.
+ */
+void cpp_warn_at(struct cpp *cpp, srcloc_t loc, char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	cpp_error_internal(cpp, ERROR_LEVEL_WARNING, loc, fmt, args);
 	va_end(args);
 }
 
@@ -127,6 +211,11 @@ static void expand_macro_invocation(struct cpp *cpp)
 	toklist_init(&invocation);
 	toklist_init(&expansion);
 
+	if (cpp->streaming && !cpp->scratch_marked) {
+		cpp->scratch_mark = mempool_get_mark(&cpp->scratch);
+		cpp->scratch_marked = true;
+	}
+
 	toklist_insert(&invocation, cpp->token); /* macro name */
 	move_next(cpp);
 
@@ -159,6 +248,9 @@ static void expand_macro_invocation(struct cpp *cpp)
 	cpp_requeue_current(cpp);
 	toklist_prepend(&cpp_this_file(cpp)->tokens, &expansion);
 	move_next(cpp);
+
+	toklist_free(&invocation);
+	toklist_free(&expansion);
 }
 
 /*
@@ -173,31 +265,67 @@ static struct token *concat_strings(struct cpp *cpp, struct toklist *literals)
 	struct token *cat;	/* the concatenation (new token) */
 	struct strbuf str;
 	struct token *first;
-	struct token *last;
-
-	toklist_foreach(literal, literals)
-		assert(token_is(literal, TOKEN_STRING_LITERAL));
 
 	strbuf_init(&str, 128);
-	toklist_foreach(literal, literals)
-		strbuf_printf(&str, "%s", literal->lstr.str);
+	toklist_foreach(literal, literals) {
+		assert(token_is(literal, TOKEN_STRING_LITERAL));
+		strbuf_printf(&str, "%s", literal->lstr->str);
+	}
 
 	first = toklist_first(literals);
-	last = toklist_last(literals);
 
 	cat = objpool_alloc(&cpp->ctx->token_pool);
 	cat->type = TOKEN_STRING_LITERAL;
-	cat->lstr.str = strbuf_copy_to_mempool(&str, &cpp->ctx->token_data);
-	cat->lstr.len = strbuf_strlen(&str);
-	cat->startloc = first->startloc;
-	cat->endloc = last->endloc;
+	cat->lstr = mempool_alloc(&cpp->ctx->token_data, sizeof(*cat->lstr));
+	cat->lstr->str = strbuf_copy_to_mempool(&str, &cpp->ctx->token_data);
+	cat->lstr->len = strbuf_strlen(&str);
+	cat->loc = first->loc;
 	cat->is_at_bol = first->is_at_bol;
 	cat->after_white = first->after_white;
+	cat->is_scratch = false;
 
 	strbuf_free(&str);
 	return cat;
 }
 
+/*
+ * Is the current token an invocation of a macro which should be expanded?
+ */
+static bool is_macro_invocation(struct cpp *cpp)
+{
+	struct macro *macro;
+
+	if (!token_is_macro(cpp->token) || cpp->token->noexpand)
+		return false;
+
+	macro = &cpp->token->symbol->def->macro;
+	return !macro_is_funclike(macro) || token_is(cpp_peek(cpp), TOKEN_LPAREN);
+}
+
+/*
+ * Skip the current token, which is within a conditional group that isn't
+ * processed. If the lexer is at the end of a line, let it skip the rest of
+ * the group without lexing it (see `lexer_skip_group') and note the gap
+ * this leaves in the recorded tokens.
+ */
+static void skip_group(struct cpp *cpp)
+{
+	struct cpp_file *file = cpp_this_file(cpp);
+	struct cpp_skip skip;
+
+	if (toklist_is_empty(&file->tokens) && !file->replay) {
+		skip.pos = array_size(file->recording);
+		skip.start = file->srcfile->inbuf.offset;
+		if (lexer_skip_group(&file->lexer)) {
+			skip.end = file->srcfile->inbuf.offset;
+			if (skip.end > skip.start)
+				array_push(file->skips, skip);
+		}
+	}
+
+	move_next(cpp);
+}
+
 /*
  * This function gets the next token and decides what to do with it. If it's
  * the start of a preprocessor directive, it processes it; if it's a macro
@@ -213,31 +341,33 @@ static struct token *concat_strings(struct cpp *cpp, struct toklist *literals)
  */
 static void run(struct cpp *cpp)
 {
-	struct macro *macro;
-
 	while (!token_is_eof(cpp->token)) {
 		if (token_is(cpp->token, TOKEN_HASH) && cpp->token->is_at_bol) {
 			cpp_process_directive(cpp);
 		}
-		else if (token_is_macro(cpp->token) && !cpp->token->noexpand) {
-			macro = &cpp->token->symbol->def->macro;
-			if (!macro_is_funclike(macro) || token_is(cpp_peek(cpp), TOKEN_LPAREN))
-				expand_macro_invocation(cpp);
-			else
-				cpp->token->noexpand = true;
-		}
 		else if (cpp_is_skip_mode(cpp)) {
-			move_next(cpp);
+			skip_group(cpp);
 		}
 		else {
-			break;
+			if (!token_is_eol(cpp->token))
+				cpp_mi_token(cpp);
+
+			if (!is_macro_invocation(cpp))
+				break;
+
+			expand_macro_invocation(cpp);
 		}
 	}
 }
 
 /******************************** public API ********************************/
 
-struct cpp *cpp_new(struct context *ctx)
+/*
+ * Create a preprocessor which uses the header search @search, which may be
+ * shared with other preprocessors, including ones running in other threads
+ * on contexts of their own. @search must outlive the preprocessor.
+ */
+struct cpp *cpp_new_shared(struct context *ctx, struct cpp_search *search)
 {
 	struct cpp *cpp;
 
@@ -249,20 +379,76 @@ struct cpp *cpp_new(struct context *ctx)
 
 	objpool_init(&cpp->macro_pool, sizeof(struct macro), MACRO_POOL_BLOCK_SIZE);
 	objpool_init(&cpp->file_pool, sizeof(struct cpp_file), FILE_POOL_BLOCK_SIZE);
+	objpool_init(&cpp->file_info_pool, sizeof(struct cpp_file_info), FILE_POOL_BLOCK_SIZE);
+	hashtab_init(&cpp->file_infos, &cpp->file_info_pool, FILE_INFOS_INIT_SIZE);
+	objpool_init(&cpp->lookup_pool, sizeof(struct cpp_lookup), LOOKUP_POOL_BLOCK_SIZE);
+	hashtab_init(&cpp->lookups, &cpp->lookup_pool, FILE_INFOS_INIT_SIZE);
+	mempool_init(&cpp->filenames, FILENAMES_BLOCK_SIZE);
+	cpp->search = search;
+	cpp->owns_search = false;
+	cpp->recorded = array_new(16, sizeof(*cpp->recorded));
 
 	list_init(&cpp->file_stack);
 
+	cpp->name_defined = intern("defined", strlen("defined"));
+	cpp->name_once = intern("once", strlen("once"));
+
+	mempool_init(&cpp->scratch, SCRATCH_BLOCK_SIZE);
+	cpp->scratch_marked = false;
+	cpp->streaming = false;
+
+	cpp->expanding = array_new(16, sizeof(*cpp->expanding));
+	cpp->args = array_new(16, sizeof(*cpp->args));
+
 	cpp_init_ifstack(cpp);
 	cpp_setup_symtab(cpp);
 
 	return cpp;
 }
 
+struct cpp *cpp_new(struct context *ctx)
+{
+	struct cpp *cpp;
+
+	cpp = cpp_new_shared(ctx, cpp_search_new());
+	cpp->owns_search = true;
+
+	return cpp;
+}
+
+/*
+ * Set the streaming mode of @cpp. In the streaming mode, the caller promises
+ * to be done with each token returned by `cpp_next' before it calls it again,
+ * so that the memory of macro expansions can be released as soon as they're
+ * consumed. Otherwise, the tokens are kept until @cpp is deleted.
+ */
+void cpp_set_streaming(struct cpp *cpp, bool streaming)
+{
+	cpp->streaming = streaming;
+}
+
 void cpp_delete(struct cpp *cpp)
 {
+	size_t i;
+
+	for (i = 0; i < array_size(cpp->recorded); i++) {
+		array_delete(cpp->recorded[i]->tokens);
+		array_delete(cpp->recorded[i]->skips);
+	}
+	array_delete(cpp->recorded);
 	objpool_free(&cpp->macro_pool);
 	objpool_free(&cpp->file_pool);
+	hashtab_free(&cpp->file_infos);
+	objpool_free(&cpp->file_info_pool);
+	hashtab_free(&cpp->lookups);
+	objpool_free(&cpp->lookup_pool);
+	mempool_free(&cpp->filenames);
+	mempool_free(&cpp->scratch);
+	if (cpp->owns_search)
+		cpp_search_delete(cpp->search);
 	list_free(&cpp->file_stack);
+	array_delete(cpp->expanding);
+	array_delete(cpp->args);
 
 	free(cpp);
 }
@@ -276,6 +462,13 @@ void cpp_delete(struct cpp *cpp)
  *       to `cpp_next' will return TOKEN_EOF as well, i.e. the TOKEN_EOF
  *       token is inedible. This way, one may always depend on TOKEN_EOF
  *       marking the end of the token stream.
+ *
+ * The tokens produced by macro expansions are allocated from `cpp->scratch'.
+ * In the streaming mode (see `cpp_set_streaming'), the scratch memory is
+ * marked before a top-level invocation is expanded, and it's released to
+ * the mark once the expansion has been consumed, i.e. once the current token
+ * isn't a scratch one, no tokens are queued and no string literals wait for
+ * concatenation.
  */
 struct token *cpp_next(struct cpp *cpp)
 {
@@ -287,6 +480,12 @@ struct token *cpp_next(struct cpp *cpp)
 	toklist_init(&stringles);
 
 	while (1) {
+		if (cpp->scratch_marked && !cpp->token->is_scratch && toklist_is_empty(&stringles)
+			&& toklist_is_empty(&cpp_this_file(cpp)->tokens)) {
+			mempool_release(&cpp->scratch, cpp->scratch_mark);
+			cpp->scratch_marked = false;
+		}
+
 		run(cpp);
 		 /* TODO refactoring aid, remove */
 		if (token_is_eol(cpp->token)) {
@@ -294,7 +493,9 @@ struct token *cpp_next(struct cpp *cpp)
 		else if (token_is(cpp->token, TOKEN_STRING_LITERAL)) {
 			toklist_insert(&stringles, cpp->token);
 		} else if (!toklist_is_empty(&stringles)) {
-			return concat_strings(cpp, &stringles);
+			tmp = concat_strings(cpp, &stringles);
+			toklist_free(&stringles);
+			return tmp;
 		} else if (token_is_eof(cpp->token)) {
 			if (list_len(&cpp->file_stack) == 1)
 				return cpp->token;
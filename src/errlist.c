@@ -6,13 +6,14 @@
 #define STRING_POOL_BLOCK_SIZE	512
 #define ERROR_POOL_BLOCK_SIZE	16
 
-void errlist_init(struct errlist *errlist)
+void errlist_init(struct errlist *errlist, struct srcmgr *srcmgr)
 {
 	size_t i;
 
 	list_init(&errlist->errors);
 	mempool_init(&errlist->string_pool, STRING_POOL_BLOCK_SIZE);
 	objpool_init(&errlist->error_pool, sizeof(struct error), ERROR_POOL_BLOCK_SIZE);
+	errlist->srcmgr = srcmgr;
 
 	for (i = 0; i < ARRAY_SIZE(errlist->num_errors_by_level); i++)
 		errlist->num_errors_by_level[i] = 0;
@@ -25,16 +26,18 @@ void errlist_free(struct errlist *errlist)
 	objpool_free(&errlist->error_pool);
 }
 
+/*
+ * Insert an error which occurred at @loc. The location is only decoded
+ * (and the context line looked up) when the error is dumped.
+ */
 void errlist_insert(struct errlist *errlist, enum error_level level,
-	char *filename, char *message, char *context, size_t context_len,
-	struct location location)
+	srcloc_t loc, char *message, bool show_context)
 {
 	struct error *error = objpool_alloc(&errlist->error_pool);
 	error->level = level;
-	error->filename = mempool_strdup(&errlist->string_pool, filename);
 	error->message = mempool_strdup(&errlist->string_pool, message);
-	error->context = mempool_memcpy(&errlist->string_pool, context, context_len);
-	error->location = location;
+	error->loc = loc;
+	error->show_context = show_context;
 
 	assert(error->level < ARRAY_SIZE(errlist->num_errors_by_level));
 	errlist->num_errors_by_level[error->level]++;
@@ -61,20 +64,27 @@ const char *error_level_to_string(enum error_level level)
 	return NULL;
 }
 
-static void error_dump(struct error *error, FILE *fout)
+static void error_dump(struct errlist *errlist, struct error *error, FILE *fout)
 {
+	struct location location;
 	size_t i;
 
-	fprintf(fout, "%s: %lu: %s: %s\n", error->filename,
-		error->location.line_no, error_level_to_string(error->level),
+	if (!srcmgr_decode(errlist->srcmgr, error->loc, &location)) {
+		fprintf(fout, "<built-in>: %s: %s\n",
+			error_level_to_string(error->level), error->message);
+		return;
+	}
+
+	fprintf(fout, "%s: %" PRIu32 ": %s: %s\n", location.filename,
+		location.line_no, error_level_to_string(error->level),
 		error->message);
 
-	if (error->context) {
-		fprintf(fout, "%s\n", error->context);
+	if (error->show_context) {
+		fprintf(fout, "%.*s\n", (int)location.line_len, location.line);
 
 		/* print the problem-mark */
-		for (i = 0; i < error->location.column_no; i++) {
-			if (error->context[i] == '\t')
+		for (i = 0; i < location.column_no; i++) {
+			if (location.line[i] == '\t')
 				fputc('\t', fout);
 			else
 				fputc(' ', fout);
@@ -87,7 +97,7 @@ static void error_dump(struct error *error, FILE *fout)
 void errlist_dump(struct errlist *errlist, FILE *fout)
 {
 	list_foreach(struct error, error, &errlist->errors, list_node) {
-		error_dump(error, fout);
+		error_dump(errlist, error, fout);
 
 		if (error != list_last(&errlist->errors))
 			fputc('\n', fout);
@@ -15,6 +15,9 @@ const char *error_str(mcc_error_t err)
 
 	case MCC_ERROR_NOENT:
 		return "File not found.";
+
+	case MCC_ERROR_TOOBIG:
+		return "Input too large.";
 	}
 
 	return NULL;
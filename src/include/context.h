@@ -5,6 +5,7 @@
 #include "errlist.h"
 #include "mempool.h"
 #include "objpool.h"
+#include "srcmgr.h"
 
 /*
  * Translation unit context. Owns objects and memory needed by multiple
@@ -13,6 +14,8 @@
 struct context
 {
 	struct symtab symtab;		/* symbol table */
+	struct filecache filecache;	/* contents of the source files (unless shared) */
+	struct srcmgr srcmgr;		/* source files */
 	struct errlist errlist;		/* error list */
 
 	struct objpool token_pool;	/* objpool for struct token */
@@ -21,6 +24,7 @@ struct context
 };
 
 void context_init(struct context *ctx);
+void context_init_shared(struct context *ctx, struct filecache *filecache);
 void context_free(struct context *ctx);
 
 #endif
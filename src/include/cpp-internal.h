@@ -1,20 +1,18 @@
 #ifndef CPP_INTERNAL_H
 #define CPP_INTERNAL_H
 
-/*
- * TODO: (Globally) Free tokens (tokinfos) which I don't need anymore
- *       Maybe use a refcount?
- */
-
 #include "common.h"
 #include "debug.h"
 #include "error.h"
+#include "hashtab.h"
 #include "lexer.h"
+#include "list.h"
 #include "mempool.h"
 #include "objpool.h"
 #include "token.h"
 #include "toklist.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -30,10 +28,30 @@ struct cpp
 	struct mempool token_data;	/* mempool for misc token data */
 	struct objpool macro_pool;	/* objpool for macros */
 	struct objpool file_pool;	/* objpool for open files */
+	struct objpool file_info_pool;	/* objpool for file infos */
+	struct hashtab file_infos;	/* file infos by canonical path */
+	struct objpool lookup_pool;	/* objpool for header lookups */
+	struct hashtab lookups;		/* cache of header lookups */
+	struct mempool filenames;	/* names of replayed files */
+	struct cpp_search *search;	/* header search, maybe shared */
+	bool owns_search;		/* was @search created by `cpp_new'? */
+	struct cpp_file_info **recorded; /* infos with recorded tokens (array.h) */
 
 	struct list file_stack;		/* stack of open files */
 	struct token *token;		/* most recent token */
 	struct list ifs;		/* if-directive control stack */
+	struct cpp_if *ifstack_bottom;	/* bottom of @ifs, see `cpp_init_ifstack' */
+
+	char *name_defined;		/* interned "defined" */
+	char *name_once;		/* interned "once" */
+
+	struct mempool scratch;		/* tokens produced by expansions, see `cpp_next' */
+	struct mempool_mark scratch_mark; /* @scratch before the expansions being consumed */
+	bool scratch_marked;		/* is @scratch_mark set? */
+	bool streaming;			/* see `cpp_set_streaming' */
+
+	struct macro **expanding;	/* macros being expanded (array.h) */
+	struct macro_arg *args;		/* args of the invocations being expanded (array.h) */
 };
 
 void cpp_dump_toklist(struct list *lst, FILE *fout);
@@ -41,27 +59,133 @@ void cpp_dump_file_stack(struct cpp *cpp);
 
 void cpp_error(struct cpp *cpp, char *fmt, ...);
 void cpp_warn(struct cpp *cpp, char *fmt, ...);
+void cpp_error_at(struct cpp *cpp, srcloc_t loc, char *fmt, ...);
+void cpp_warn_at(struct cpp *cpp, srcloc_t loc, char *fmt, ...);
 
 void move_next(struct cpp *cpp);
 struct token *cpp_peek(struct cpp *cpp);
+struct token *cpp_scratch_token(struct cpp *cpp);
 
 bool cpp_is_skip_mode(struct cpp *cpp);
 
+/*
+ * Information about a file which outlives its inclusions. There's one
+ * per canonical path, shared by all the paths through which the file
+ * is included.
+ *
+ * Once a file is lexed completely, the tokens it consists of are kept in
+ * @tokens, and later includes of the file replay them instead of lexing the
+ * file again. That's possible because the lexer only depends on the file,
+ * and because the tokens aren't modified once lexed.
+ *
+ * Groups of lines skipped without being lexed (see `skip_group') leave
+ * gaps in the recording, which are listed in @skips.
+ */
+struct cpp_file_info
+{
+	struct hashnode hashnode;	/* allows infos to be hashed by path */
+	struct symbol *guard;		/* macro of the include guard or NULL */
+	bool once;			/* did the file contain #pragma once? */
+	struct token **tokens;		/* tokens of the file or NULL (array.h) */
+	struct cpp_skip *skips;		/* gaps in @tokens (array.h) */
+	struct srcfile *srcfile;	/* the file @tokens were lexed from */
+};
+
+/*
+ * Lines of a file which were skipped without being lexed. They are
+ * [@start, @end) of the contents of the file and they come right before
+ * the recorded token number @pos.
+ */
+struct cpp_skip
+{
+	size_t pos;			/* position in the recorded tokens */
+	size_t start;			/* offset of the first skipped line */
+	size_t end;			/* offset of the line after the last one */
+};
+
+/*
+ * State of the multiple-include optimization of an open file. The file is
+ * guarded if all it contains, apart from whitespace and comments, is a single
+ * #ifndef GUARD ... #endif block. Once the file is closed, GUARD is recorded
+ * in its `cpp_file_info' and later includes are skipped while GUARD is defined.
+ */
+enum cpp_mi_state
+{
+	CPP_MI_START,			/* nothing seen yet */
+	CPP_MI_IN_GUARD,		/* inside of the #ifndef GUARD block */
+	CPP_MI_AFTER_GUARD,		/* after the #endif of the block */
+	CPP_MI_NONE,			/* the file isn't guarded */
+};
+
+/*
+ * Header search: the directories searched for included files and the
+ * results of the searches. The search may be shared by preprocessors
+ * running in different threads (see `cpp_new_shared'); once the first
+ * file is searched for, the directories don't change and the results are
+ * only added to, under @lock.
+ */
+struct cpp_search
+{
+	char **include_dirs;		/* -I directories (array.h) */
+	char **system_dirs;		/* -isystem directories (array.h) */
+	struct objpool result_pool;	/* objpool for the results */
+	struct hashtab results;		/* results by key, see `lookup_file' */
+	struct mempool data;		/* paths of the results and dirs */
+	pthread_mutex_t lock;		/* protects @results and @data */
+};
+
+/*
+ * Result of a header search, see `search_lookup'.
+ */
+struct cpp_search_result
+{
+	struct hashnode hashnode;	/* allows results to be hashed */
+	char *path;			/* path of the file or NULL if not found */
+	char *canon;			/* canonical path or NULL if not found */
+};
+
+/*
+ * Cached result of a header lookup, see `lookup_file'. It's a
+ * `cpp_search_result' bound to the file info of this preprocessor.
+ */
+struct cpp_lookup
+{
+	struct hashnode hashnode;	/* allows lookups to be hashed */
+	char *path;			/* path of the file or NULL if not found */
+	struct cpp_file_info *info;	/* info of the file or NULL if not found */
+};
+
+struct cpp_if;
+
 struct cpp_file
 {
 	struct lnode list_node;
 	char *filename;
 	struct lexer lexer;
-	struct inbuf inbuf;
+	struct srcfile *srcfile;	/* the file being lexed or NULL */
 	struct toklist tokens;		/* token queue */
+	struct cpp_file_info *info;	/* info of the file */
+	struct token **replay;		/* tokens being replayed or NULL */
+	size_t replay_pos;		/* position of the next token in @replay */
+	size_t skip_pos;		/* next gap in @replay, see `cpp_skip' */
+	bool lexing_skip;		/* lexing the gap instead of replaying? */
+	struct inbuf skip_inbuf;	/* contents of the gap being lexed */
+	struct token **recording;	/* tokens lexed so far (array.h) */
+	struct cpp_skip *skips;		/* gaps in @recording (array.h) */
+	srcloc_t line_loc;		/* line of the most recently read token */
+	enum cpp_mi_state mi_state;	/* see enum cpp_mi_state */
+	struct symbol *mi_guard;	/* the GUARD of the #ifndef GUARD block */
+	struct cpp_if *mi_if;		/* the #ifndef GUARD block */
+	struct cpp_if *outer_if;	/* top of the #if stack when included */
 };
 
-mcc_error_t cpp_file_init(struct cpp *cpp, struct cpp_file *file, char *filename);
+mcc_error_t cpp_file_init(struct cpp *cpp, struct cpp_file *file, char *filename,
+	struct cpp_file_info *info);
 
 mcc_error_t cpp_open_file(struct cpp *cpp, char *filename);
 void cpp_close_file(struct cpp *cpp);
-mcc_error_t cpp_file_include_hheader(struct cpp *cpp, char *filename, struct cpp_file *file);
-mcc_error_t cpp_file_include_qheader(struct cpp *cpp, char *filename, struct cpp_file *file);
+mcc_error_t cpp_file_include_hheader(struct cpp *cpp, char *filename, struct cpp_file **file);
+mcc_error_t cpp_file_include_qheader(struct cpp *cpp, char *filename, struct cpp_file **file);
 void cpp_file_include(struct cpp *cpp, struct cpp_file *file);
 bool cpp_expect(struct cpp *cpp, enum token_type token);
 struct cpp_file *cpp_this_file(struct cpp *cpp);
@@ -89,6 +213,12 @@ void cpp_setup_symtab_directives(struct symtab *table);
 void cpp_process_directive(struct cpp *cpp);
 void cpp_init_ifstack(struct cpp *cpp);
 
+bool cpp_eval_expr(struct cpp *cpp, struct toklist *expr, srcloc_t loc);
+
+void cpp_mi_begin(struct cpp *cpp, struct cpp_file *file);
+void cpp_mi_end(struct cpp *cpp, struct cpp_file *file);
+void cpp_mi_token(struct cpp *cpp);
+
 /*
  * C preprocessor macro flags.
  */
@@ -104,6 +234,27 @@ enum macro_flags
 struct macro;
 typedef void (macro_handler_t)(struct cpp *cpp, struct macro *macro, struct toklist *out);
 
+/*
+ * Instructions of compiled replacement lists, see `macro_compile'.
+ */
+enum macro_opcode
+{
+	MACRO_OP_TOKENS,	/* @count tokens of the list, starting at @index */
+	MACRO_OP_ARG,		/* argument number @index, macro-expanded */
+	MACRO_OP_STRINGIFY,	/* argument number @index, stringified (#) */
+	MACRO_OP_PASTE_ARG,	/* argument number @index, unexpanded (left operand of ##) */
+	MACRO_OP_PASTE,		/* last token pasted with the operand at @index (##) */
+};
+
+struct macro_op
+{
+	enum macro_opcode opcode;	/* see enum macro_opcode */
+	uint32_t index;			/* token of the list or argument number */
+	uint32_t count;			/* number of tokens (MACRO_OP_TOKENS) */
+	int rhs_arg;			/* argument of the right operand of ## or -1 */
+	bool rhs_stringify;		/* is the right operand of ## #arg? */
+};
+
 /*
  * C preprocessor macro.
  */
@@ -112,16 +263,19 @@ struct macro
 	char *name;			/* name of the macro */
 	struct toklist args;		/* argument list */
 	struct toklist expansion;	/* expansion list */
+	struct macro_op *ops;		/* compiled expansion list (array.h) */
+	bool *expand_args;		/* is the expansion of each arg used? */
 	macro_handler_t *handler;	/* handler (optional, rare) */
-	bool is_expanding;		/* is this macro being expanded? */
 	enum macro_flags flags;		/* see enum macro_flags */
 };
 
 void macro_init(struct macro *macro);
 void macro_init_parse(struct macro *macro, char *input);
 void macro_free(struct macro *macro);
+void macro_compile(struct macro *macro);
 
 void macro_expand(struct cpp *file, struct toklist *invocation, struct toklist *expansion);
+void macro_expand_list(struct cpp *cpp, struct toklist *in, struct toklist *out);
 
 bool macro_is_funclike(struct macro *macro);
 void macro_dump(struct macro *macro);
@@ -3,10 +3,19 @@
 
 #include "context.h"
 #include "error.h"
+#include <stdbool.h>
+
+struct cpp_search *cpp_search_new(void);
+void cpp_search_delete(struct cpp_search *search);
+void cpp_search_add_dir(struct cpp_search *search, char *dir, bool is_system);
 
 struct cpp *cpp_new(struct context *ctx);
+struct cpp *cpp_new_shared(struct context *ctx, struct cpp_search *search);
 void cpp_delete(struct cpp *cpp);
 
+void cpp_add_include_dir(struct cpp *cpp, char *dir, bool is_system);
+void cpp_set_streaming(struct cpp *cpp, bool streaming);
+
 mcc_error_t cpp_open_file(struct cpp *cpp, char *filename);
 void cpp_close_file(struct cpp *file);
 
@@ -8,7 +8,7 @@
 #include "list.h"
 #include "mempool.h"
 #include "objpool.h"
-#include "token.h"
+#include "srcmgr.h"
 #include <stdio.h>
 
 struct errlist
@@ -17,9 +17,10 @@ struct errlist
 	size_t num_errors_by_level[4];	/* number of errors with given level */
 	struct mempool string_pool;	/* mempool for strings */
 	struct objpool error_pool;	/* objpool for errors */
+	struct srcmgr *srcmgr;		/* source manager to decode locations */
 };
 
-void errlist_init(struct errlist *errlist);
+void errlist_init(struct errlist *errlist, struct srcmgr *srcmgr);
 void errlist_free(struct errlist *errlist);
 
 void errlist_dump(struct errlist *errlist, FILE *fout);
@@ -38,14 +39,12 @@ struct error
 {
 	struct lnode list_node;
 	enum error_level level;
-	char *filename;
 	char *message;
-	char *context;
-	struct location location;
+	srcloc_t loc;		/* where the error occurred */
+	bool show_context;	/* print the line which contains @loc? */
 };
 
 void errlist_insert(struct errlist *errlist, enum error_level level,
-	char *filename, char *message, char *context, size_t context_len,
-	struct location location);
+	srcloc_t loc, char *message, bool show_context);
 
 #endif
@@ -6,6 +6,7 @@ enum mcc_error {
 	MCC_ERROR_EOF,
 	MCC_ERROR_OK,
 	MCC_ERROR_NOENT,
+	MCC_ERROR_TOOBIG,
 };
 
 typedef enum mcc_error mcc_error_t;
@@ -6,6 +6,7 @@
 #define DOUBLE_TFLAGS	(TFLAG_LONG | TFLAG_COMPLEX)
 
 #include "decl.h"
+#include <stdlib.h>
 
 /*
  * C keyword.
@@ -60,4 +61,12 @@ struct kwdinfo
 
 extern const struct kwdinfo kwdinfo[44];
 
+/*
+ * Number of slots of the perfect hash table of reserved names (C keywords
+ * and CPP directive names), see `reserved_lookup'.
+ */
+#define RESERVED_SLOTS	128
+
+int reserved_lookup(const char *name, size_t len);
+
 #endif
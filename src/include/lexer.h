@@ -20,14 +20,16 @@
 struct lexer
 {
 	struct context *ctx;
-	char *filename;			/* TODO */
+	struct mempool *token_data;	/* memory for the data of the tokens */
 
 	struct inbuf *inbuf;		/* input buffer */
-	struct strbuf linebuf;		/* buffer for current logical line */
-	char *c;			/* current character within linebuf */
-	struct location location;	/* location of c within inbuf */
+	srcloc_t base;			/* location of the start of inbuf */
+	struct strbuf linebuf;		/* buffer for lines which need rewriting */
+	char *line;			/* current logical line (in inbuf or linebuf) */
+	char *line_end;			/* end of the current logical line */
+	char *c;			/* current character within line */
+	srcloc_t line_loc;		/* location of the start of line */
 	struct strbuf strbuf;		/* buffer for various string accumulation */
-	struct strbuf spelling;		/* buffer for token spelling */
 	char *spelling_start;		/* start of current token's spelling */
 
 	/* flags */
@@ -37,8 +39,10 @@ struct lexer
 	bool had_whitespace;		/* whitespace before current token? */
 };
 
-void lexer_init(struct lexer *lexer, struct context *ctx, struct inbuf *inbuf);
+void lexer_init(struct lexer *lexer, struct context *ctx, struct inbuf *inbuf,
+	srcloc_t base);
 void lexer_free(struct lexer *lexer);
 void lexer_next(struct lexer *lexer, struct token *token);
+bool lexer_skip_group(struct lexer *lexer);
 
 #endif
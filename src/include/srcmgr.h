@@ -0,0 +1,65 @@
+/*
+ * srcmgr:
+ * Source manager. Owns the contents of all source files of the translation
+ * unit and maps source locations to (file, line, column) triples.
+ *
+ * A source location is a 32-bit offset into a single address space in which
+ * each file occupies a contiguous range of locations, one per byte (plus one
+ * for the end of the file). Tokens only carry the location, the line and
+ * column are computed on demand, using line tables which are built lazily
+ * the first time a location within the file is decoded.
+ */
+
+#ifndef SRCMGR_H
+#define SRCMGR_H
+
+#include "error.h"
+#include "filecache.h"
+#include "inbuf.h"
+#include "mempool.h"
+#include "objpool.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef uint32_t srcloc_t;
+
+#define SRCLOC_NONE	0	/* no (or unknown) location */
+
+/*
+ * Decoded source location.
+ */
+struct location
+{
+	char *filename;			/* name of the file */
+	uint32_t line_no;		/* line number (starting at 1) */
+	uint32_t column_no;		/* column number (starting at 0) */
+	char *line;			/* the line itself */
+	size_t line_len;		/* length of @line */
+};
+
+struct srcfile
+{
+	char *filename;			/* name of the file */
+	struct inbuf inbuf;		/* contents of the file */
+	srcloc_t base;			/* location of the first byte */
+	uint32_t *line_starts;		/* offsets of line starts (lazy, array.h) */
+};
+
+struct srcmgr
+{
+	struct filecache *filecache;	/* contents of the files */
+	struct objpool file_pool;	/* objpool for struct srcfile */
+	struct mempool filenames;	/* mempool for file names */
+	struct srcfile **files;		/* files ordered by base (array.h) */
+	srcloc_t next_base;		/* base of the next file */
+};
+
+void srcmgr_init(struct srcmgr *srcmgr, struct filecache *filecache);
+void srcmgr_free(struct srcmgr *srcmgr);
+
+mcc_error_t srcmgr_open(struct srcmgr *srcmgr, char *filename, struct srcfile **file);
+
+bool srcmgr_decode(struct srcmgr *srcmgr, srcloc_t loc, struct location *location);
+
+#endif
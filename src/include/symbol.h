@@ -9,6 +9,7 @@
 #include "cpp-internal.h"
 #include "hashtab.h"
 #include "keyword.h"
+#include "list.h"
 #include "objpool.h"
 #include <stdbool.h>
 #include <stdio.h>
@@ -28,6 +29,7 @@ struct symtab
 	struct hashtab table;		/* hash table for the symbols */
 	struct list scope_stack;	/* stack of active scopes */
 	struct scope file_scope;	/* file (global) scope */
+	struct symbol *reserved[RESERVED_SLOTS];	/* symbols of reserved names */
 };
 
 void symtab_init(struct symtab *table);
@@ -37,6 +39,8 @@ struct symbol *symtab_search(struct symtab *symtab, char *name);
 bool symtab_contains(struct symtab *symtab, char *name);
 struct symbol *symtab_insert(struct symtab *table, char *name);
 struct symbol *symtab_find_or_insert(struct symtab *table, char *name);
+struct symbol *symtab_find_or_insert_hash(struct symtab *table, char *name, size_t len,
+	uint32_t hash);
 
 void symtab_scope_begin(struct symtab *table);
 void symtab_scope_end(struct symtab *table);
@@ -47,7 +51,6 @@ enum symbol_type
 {
 	SYMBOL_TYPE_CPP_DIRECTIVE,	/* C preprocessor directive */
 	SYMBOL_TYPE_CPP_MACRO,		/* C preprocessor macro */
-	SYMBOL_TYPE_CPP_MACRO_ARG,	/* C preprocessor's macro argument */
 	SYMBOL_TYPE_C_KEYWORD,		/* C language keyword */
 	SYMBOL_TYPE_UNDEF		/* symbol has no proper definition */
 };
@@ -74,7 +77,6 @@ struct symdef
 		enum cpp_directive directive;	/* C preprocessor directive */
 		const struct kwdinfo *kwdinfo;	/* C keyword */
 		struct macro macro;		/* C preprocessor macro */
-		struct macro_arg macro_arg;	/* argument of a C preprocessor macro */
 	};
 };
 
@@ -2,9 +2,10 @@
 #define TOKEN_H
 
 #include "keyword.h"
-#include "list.h"
 #include "lstr.h"
+#include "srcmgr.h"
 #include "strbuf.h"
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -86,13 +87,6 @@ enum token_type
 	TOKEN_EOF, TOKEN_EOL, TOKEN_PLACEMARKER
 };
 
-struct location
-{
-	char *filename;
-	size_t line_no;
-	size_t column_no;
-};
-
 void location_dump(struct location *loc);
 
 /*
@@ -107,38 +101,44 @@ enum enc_prefix
 	ENC_PREFIX_U8,		/* u8"string */
 };
 
+/*
+ * Tokens are the most numerous objects by far, so they're kept compact:
+ * 24 bytes on 64-bit platforms. The location is a single `srcloc_t', see
+ * `struct srcmgr'. Anything that doesn't fit in a pointer
+ * (string literals) is stored out of line in the token data.
+ */
 struct token
 {
-	struct lnode list_node;	/* node for token lists */
 	char *spelling;			/* token as given in input */
 
-	enum token_type type;		/* token type */
-
 	union
 	{
 		struct symbol *symbol;	/* for name tokens */
 		char *str;		/* for pp-numbers, header names */
-		struct lstr lstr;	/* for string literals */
+		struct lstr *lstr;	/* for string literals */
 		int value;		/* for number and char const tokens */
 	};
 
-	struct location startloc;	/* location where the token begins */
-	struct location endloc;		/* location where the token ends */
+	srcloc_t loc;			/* location where the token begins */
+
+	uint8_t type;			/* token type, see enum token_type */
 
 	/* flags */
 	bool after_white:1;		/* preceded by whitespace? */
 	bool is_at_bol:1;		/* is at beginning of line? */
 	bool noexpand:1;		/* don't expand this token */
+	bool is_scratch:1;		/* allocated by `cpp_scratch_token'? */
 	int enc_prefix:4;		/* encoding prefix */
 };
 
+_Static_assert(TOKEN_PLACEMARKER <= UINT8_MAX, "token types must fit in struct token's type");
+
 const char *token_get_name(enum token_type token);
 char *token_get_spelling(struct token *token);
 
 bool token_is(struct token *token, enum token_type token_type);
 bool token_is_name(struct token *token);
 bool token_is_macro(struct token *token);
-bool token_is_macro_arg(struct token *token);
 bool token_is_eof(struct token *token);
 bool token_is_eol(struct token *token);
 bool token_is_eof_or_bol(struct token *token);
@@ -6,53 +6,90 @@
 #ifndef TOKLIST_H
 #define TOKLIST_H
 
-#include "list.h"
 #include "strbuf.h"
+#include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 struct context;
+struct token;
 
+/*
+ * Iterate over the tokens of @lst. The list mustn't be modified within
+ * the loop.
+ */
 #define toklist_foreach(item, lst) \
-	for (struct token *item = container_of(toklist_first(lst), struct token, list_node); \
-		item != offsetof(struct token, list_node); \
-		item = container_of(item->list_node.next, struct token, list_node))
+	for (struct token *item, **item##_it = toklist_begin(lst); \
+		item##_it < toklist_end(lst) && (item = *item##_it, true); \
+		item##_it++)
 
+/*
+ * Growable array of token pointers used as a double-ended queue. The tokens
+ * are `tokens[head]' through `tokens[head + count - 1]', the free space
+ * on both sides of them allows O(1) (amortized) insertions and removals at
+ * either end, and any token can be accessed by its index.
+ */
 struct toklist
 {
-	struct list tokens;
+	struct token **tokens;		/* buffer of @size token pointers */
+	size_t head;			/* index of the first token in @tokens */
+	size_t count;			/* number of tokens in the list */
+	size_t size;			/* size of the buffer */
 };
 
 void toklist_init(struct toklist *lst);
 void toklist_free(struct toklist *lst);
 
+static inline size_t toklist_length(struct toklist *lst)
+{
+	return lst->count;
+}
+
+static inline bool toklist_is_empty(struct toklist *lst)
+{
+	return lst->count == 0;
+}
+
+static inline struct token **toklist_begin(struct toklist *lst)
+{
+	return lst->tokens + lst->head;
+}
+
+static inline struct token **toklist_end(struct toklist *lst)
+{
+	return lst->tokens + lst->head + lst->count;
+}
+
+/*
+ * Return the token at index @i, or NULL if there are fewer tokens.
+ */
+static inline struct token *toklist_at(struct toklist *lst, size_t i)
+{
+	return i < lst->count ? lst->tokens[lst->head + i] : NULL;
+}
+
 struct token *toklist_first(struct toklist *lst);
 struct token *toklist_last(struct toklist *lst);
-struct token *toklist_next(struct token *token);
-
-bool toklist_is_empty(struct toklist *lst);
-size_t toklist_length(struct toklist *lst);
 
 struct token *toklist_insert_first(struct toklist *lst, struct token *token);
 struct token *toklist_insert(struct toklist *lst, struct token *token);
 
 void toklist_prepend(struct toklist *lst, struct toklist *lst_to_prepend);
 void toklist_append(struct toklist *lst, struct toklist *lst_to_append);
+void toklist_extend(struct toklist *lst, struct toklist *src);
+void toklist_extend_range(struct toklist *lst, struct toklist *src, size_t first, size_t count);
 
 struct token *toklist_remove_first(struct toklist *lst);
 struct token *toklist_remove_last(struct toklist *lst);
-struct token *toklist_remove(struct toklist *lst, struct token *token);
-void toklist_remove_range(struct toklist *lst, struct token *a, struct token *b);
+void toklist_remove_first_n(struct toklist *lst, size_t n);
 
 void toklist_print(struct toklist *tokens, struct strbuf *buf);
 void toklist_dump(struct toklist *tokens, FILE *fout);
 
-void toklist_copy(struct context *ctx, struct toklist *src, struct toklist *dst);
-
-void toklist_load_from_strbuf(struct toklist *lst, struct context *ctx, struct strbuf *str);
-void toklist_load_from_string(struct toklist *lst, struct context *ctx, char *str, ...);
-
-bool toklist_contains(struct toklist *lst, struct token *token);
+void toklist_load_from_strbuf(struct toklist *lst, struct context *ctx, struct mempool *scratch,
+	struct strbuf *str);
+void toklist_load_from_string(struct toklist *lst, struct context *ctx, struct mempool *scratch,
+	char *str, ...);
 
 #endif
@@ -1,4 +1,6 @@
 #include "keyword.h"
+#include <inttypes.h>
+#include <string.h>
 
 /*
  * Definition of C keywords.
@@ -171,7 +173,7 @@ const struct kwdinfo kwdinfo[44] = {
 		.name = "restrict",
 		.kwd = KWD_RESTRICT,
 		.class = KWD_CLASS_TQUAL,
-		.storcls = TQUAL_RESTRICT,
+		.tqual = TQUAL_RESTRICT,
 	},
 	{
 		.name = "return",
@@ -247,3 +249,104 @@ const struct kwdinfo kwdinfo[44] = {
 		.class = KWD_CLASS_OTHER
 	},
 };
+
+/*
+ * Perfect hash table of the reserved names: C keywords and names of CPP
+ * directives. The hash of a name is computed from its first two characters,
+ * its last character and its length packed into a 32-bit word, which is
+ * multiplied by RESERVED_HASH_MUL. The top RESERVED_HASH_BITS bits of the
+ * product are the slot.
+ *
+ * The multiplier was found by a brute-force search for a constant which maps
+ * all the names to distinct slots. If a name is added, the search has to be
+ * repeated (and the table regenerated).
+ */
+#define RESERVED_HASH_MUL	0xbe3d94edU
+#define RESERVED_HASH_BITS	7
+#define RESERVED_MIN_LEN	2
+#define RESERVED_MAX_LEN	14
+
+static const struct
+{
+	const char *name;
+	size_t len;
+} reserved_names[RESERVED_SLOTS] = {
+	[0] = { "_Static_assert", 14 },
+	[3] = { "union", 5 },
+	[9] = { "elif", 4 },
+	[15] = { "break", 5 },
+	[16] = { "typedef", 7 },
+	[18] = { "switch", 6 },
+	[34] = { "void", 4 },
+	[39] = { "_Atomic", 7 },
+	[41] = { "double", 6 },
+	[46] = { "case", 4 },
+	[47] = { "undef", 5 },
+	[48] = { "const", 5 },
+	[51] = { "struct", 6 },
+	[54] = { "error", 5 },
+	[55] = { "continue", 8 },
+	[56] = { "do", 2 },
+	[57] = { "signed", 6 },
+	[58] = { "ifndef", 6 },
+	[59] = { "extern", 6 },
+	[61] = { "endif", 5 },
+	[63] = { "else", 4 },
+	[64] = { "auto", 4 },
+	[65] = { "static", 6 },
+	[66] = { "goto", 4 },
+	[68] = { "ifdef", 5 },
+	[69] = { "_Alignas", 8 },
+	[70] = { "volatile", 8 },
+	[71] = { "return", 6 },
+	[73] = { "default", 7 },
+	[74] = { "long", 4 },
+	[75] = { "short", 5 },
+	[76] = { "for", 3 },
+	[77] = { "char", 4 },
+	[78] = { "sizeof", 6 },
+	[80] = { "enum", 4 },
+	[81] = { "pragma", 6 },
+	[85] = { "_Thread_local", 13 },
+	[86] = { "_Generic", 8 },
+	[87] = { "_Noreturn", 9 },
+	[92] = { "include", 7 },
+	[94] = { "register", 8 },
+	[95] = { "int", 3 },
+	[96] = { "if", 2 },
+	[102] = { "inline", 6 },
+	[103] = { "_Imaginary", 10 },
+	[106] = { "while", 5 },
+	[113] = { "float", 5 },
+	[115] = { "restrict", 8 },
+	[117] = { "define", 6 },
+	[118] = { "_Complex", 8 },
+	[119] = { "_Bool", 5 },
+	[124] = { "line", 4 },
+	[125] = { "_Alignof", 8 },
+	[126] = { "unsigned", 8 },
+};
+
+/*
+ * Find the slot of the reserved name @name of length @len. Return -1 if
+ * @name isn't a reserved name.
+ */
+int reserved_lookup(const char *name, size_t len)
+{
+	uint32_t key;
+	int slot;
+
+	if (len < RESERVED_MIN_LEN || len > RESERVED_MAX_LEN)
+		return -1;
+
+	key = (uint8_t)name[0]
+		| (uint8_t)name[1] << 8
+		| (uint32_t)(uint8_t)name[len - 1] << 16
+		| (uint32_t)len << 24;
+	slot = (uint32_t)(key * RESERVED_HASH_MUL) >> (32 - RESERVED_HASH_BITS);
+
+	if (reserved_names[slot].len != len || memcmp(reserved_names[slot].name, name, len) != 0)
+		return -1;
+
+	return slot;
+}
@@ -2,6 +2,7 @@
 #include "debug.h"
 #include "lexer.h"
 #include "print.h"
+#include "scan.h"
 #include "symbol.h"
 #include <assert.h>
 #include <ctype.h>
@@ -43,35 +44,54 @@ static const char trigraph[256] = {
 	['-'] = '~',
 };
 
-void lexer_init(struct lexer *lexer, struct context *ctx, struct inbuf *inbuf)
+/*
+ * Initialize the lexer to read from @inbuf, whose first byte is at location
+ * @base. Tokens lexed from inputs which aren't source files (@base is
+ * SRCLOC_NONE) have no location.
+ */
+void lexer_init(struct lexer *lexer, struct context *ctx, struct inbuf *inbuf,
+	srcloc_t base)
 {
 	strbuf_init(&lexer->linebuf, STRBUF_INIT_SIZE);
 	strbuf_init(&lexer->strbuf, STRBUF_INIT_SIZE);
-	strbuf_init(&lexer->spelling, STRBUF_INIT_SIZE);
 
 	lexer->ctx = ctx;
+	lexer->token_data = &ctx->token_data;
 	lexer->inbuf = inbuf;
+	lexer->base = base;
 
 	lexer->c = strbuf_get_string(&lexer->linebuf);
-	lexer->location.line_no = 0;
+	lexer->line = lexer->c;
+	lexer->line_end = lexer->c;
+	lexer->line_loc = SRCLOC_NONE;
 	lexer->inside_include = false;
 	lexer->next_at_bol = true;
 	lexer->first_token = true;
 	lexer->had_whitespace = false;
-
-	lexer->filename = NULL; /* TODO */
 }
 
 void lexer_free(struct lexer *lexer)
 {
 	strbuf_free(&lexer->linebuf);
 	strbuf_free(&lexer->strbuf);
-	strbuf_free(&lexer->spelling);
+}
+
+/*
+ * Location of the current character. Lines which were rewritten in
+ * translation phases 1 and 2 are offset from where they start in the
+ * input, so the location is exact only for lines read in place, but it's
+ * always within the right logical line.
+ */
+static inline srcloc_t lexer_loc(struct lexer *lexer)
+{
+	if (lexer->line_loc == SRCLOC_NONE)
+		return SRCLOC_NONE;
+
+	return lexer->line_loc + (lexer->c - lexer->line);
 }
 
 static void lexer_error_internal(struct lexer *lexer, enum error_level level,
-	char *fmt, va_list args, char *context, size_t context_len,
-	struct location location)
+	char *fmt, va_list args, bool show_context)
 {
 	struct strbuf msg;
 
@@ -80,11 +100,9 @@ static void lexer_error_internal(struct lexer *lexer, enum error_level level,
 
 	errlist_insert(&lexer->ctx->errlist,
 		level,
-		lexer->filename,
+		lexer_loc(lexer),
 		strbuf_get_string(&msg),
-		context,
-		context_len,
-		location);
+		show_context);
 
 	strbuf_free(&msg);
 }
@@ -92,14 +110,8 @@ static void lexer_error_internal(struct lexer *lexer, enum error_level level,
 static void lexer_error(struct lexer *lexer, char *fmt, ...)
 {
 	va_list args;
-
-	/* TODO unhack this */
-	lexer->location.column_no = lexer->c - strbuf_get_string(&lexer->linebuf);
-
 	va_start(args, fmt);
-	lexer_error_internal(lexer, ERROR_LEVEL_ERROR, fmt, args,
-		strbuf_get_string(&lexer->linebuf), strbuf_strlen(&lexer->linebuf) + 1, // TODO
-		lexer->location);
+	lexer_error_internal(lexer, ERROR_LEVEL_ERROR, fmt, args, true);
 	va_end(args);
 }
 
@@ -107,27 +119,50 @@ static void lexer_error_noctx(struct lexer *lexer, char *fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	lexer_error_internal(lexer, ERROR_LEVEL_ERROR, fmt, args, NULL, 0,
-		lexer->location);
+	lexer_error_internal(lexer, ERROR_LEVEL_ERROR, fmt, args, false);
 	va_end(args);
 }
 
+static inline bool lexer_is_eol(struct lexer *lexer)
+{
+	return lexer->c >= lexer->line_end;
+}
+
 static inline void lexer_spelling_start(struct lexer *lexer)
 {
 	lexer->spelling_start = lexer->c;
 }
 
+/*
+ * Copy the spelling of the current token, [spelling_start, c), straight
+ * from the line to token data. Tokens whose spelling is already stored
+ * elsewhere (names, pp-numbers, one-character tokens) don't use this,
+ * see the callers.
+ */
 static inline char *lexer_spelling_end(struct lexer *lexer)
 {
 	assert(lexer->c >= lexer->spelling_start);
 
-	char *c;
+	return mempool_strndup(lexer->token_data, lexer->spelling_start,
+		lexer->c - lexer->spelling_start);
+}
 
-	strbuf_reset(&lexer->spelling);
-	for (c = lexer->spelling_start; c < lexer->c; c++)
-		strbuf_putc(&lexer->spelling, *c);
-	
-	return strbuf_copy_to_mempool(&lexer->spelling, &lexer->ctx->token_data);
+/*
+ * Spellings of one-character tokens: a NUL-terminated string for each
+ * character, so that these needn't be allocated per token.
+ */
+#define ONE_CHAR(n)	{ (char)(n), '\0' }
+#define ONE_CHAR4(n)	ONE_CHAR(n), ONE_CHAR(n + 1), ONE_CHAR(n + 2), ONE_CHAR(n + 3)
+#define ONE_CHAR16(n)	ONE_CHAR4(n), ONE_CHAR4(n + 4), ONE_CHAR4(n + 8), ONE_CHAR4(n + 12)
+#define ONE_CHAR64(n)	ONE_CHAR16(n), ONE_CHAR16(n + 16), ONE_CHAR16(n + 32), ONE_CHAR16(n + 48)
+
+static const char one_char_spelling[256][2] = {
+	ONE_CHAR64(0), ONE_CHAR64(64), ONE_CHAR64(128), ONE_CHAR64(192)
+};
+
+static inline char *lexer_one_char_spelling(char c)
+{
+	return (char *)one_char_spelling[(unsigned char)c];
 }
 
 inline static bool is_ascii_letter(int c)
@@ -292,29 +327,49 @@ static uint64_t lexer_read_ucn(struct lexer *lexer)
 	return number;
 }
 
+static inline bool lexer_at_ucn(struct lexer *lexer)
+{
+	return *lexer->c == '\\' && (lexer->c[1] == 'u' || lexer->c[1] == 'U');
+}
+
 static struct token *lexer_lex_name(struct lexer *lexer, struct token *token)
 {
+	char *name = lexer->c;
+	size_t len;
+
+	lexer->c = scanner->name_end(lexer->c, lexer->line_end);
+	token->type = TOKEN_NAME;
+
+	/*
+	 * Unless there are UCNs, the name is contiguous within the line. It's
+	 * hashed right after it was scanned and looked up in place, and the
+	 * spelling is the (interned) symbol name.
+	 */
+	if (!lexer_at_ucn(lexer)) {
+		len = lexer->c - name;
+		token->symbol = symtab_find_or_insert_hash(&lexer->ctx->symtab,
+			name, len, hashtab_hash(name, len));
+		token->spelling = symbol_get_name(token->symbol);
+		return token;
+	}
+
 	strbuf_reset(&lexer->strbuf);
+	strbuf_putn(&lexer->strbuf, name, lexer->c - name);
 
-	while (is_ascii_letter(*lexer->c) || is_digit(*lexer->c) || *lexer->c == '_' || *lexer->c == '\\') {
-		if (*lexer->c == '\\') {
-			DEBUG_TRACE;
-			if (lexer->c[1] == 'u' || lexer->c[1] == 'U') {
-				lexer->c++;
-				strbuf_putwc(&lexer->strbuf, lexer_read_ucn(lexer));
-			}
-			else {
-				break;
-			}
-		}
-		else {
-			strbuf_putc(&lexer->strbuf, *lexer->c);
-			lexer->c++;
-		}
+	while (lexer_at_ucn(lexer)) {
+		DEBUG_TRACE;
+		lexer->c++;
+		strbuf_putwc(&lexer->strbuf, lexer_read_ucn(lexer));
+
+		name = lexer->c;
+		lexer->c = scanner->name_end(lexer->c, lexer->line_end);
+		strbuf_putn(&lexer->strbuf, name, lexer->c - name);
 	}
 
-	token->type = TOKEN_NAME;
-	token->symbol = symtab_find_or_insert(&lexer->ctx->symtab, strbuf_get_string(&lexer->strbuf));
+	name = strbuf_get_string(&lexer->strbuf);
+	len = strbuf_strlen(&lexer->strbuf);
+	token->symbol = symtab_find_or_insert_hash(&lexer->ctx->symtab,
+		name, len, hashtab_hash(name, len));
 	token->spelling = lexer_spelling_end(lexer);
 
 	return token;
@@ -328,7 +383,7 @@ static struct token *lexer_lex_char(struct lexer *lexer, struct token *token)
 
 	assert(lexer->c[-1] == '\'');
 
-	for (i = 0; *lexer->c != '\0'; i++) {
+	for (i = 0; !lexer_is_eol(lexer) && *lexer->c != '\0'; i++) {
 		if (*lexer->c == '\'') {
 			seen_delimiter = true;
 			lexer->c++;
@@ -361,49 +416,51 @@ static struct token *lexer_lex_char(struct lexer *lexer, struct token *token)
 	return token;
 }
 
-static inline bool lexer_is_eol(struct lexer *lexer)
-{
-	return (size_t)(lexer->c - strbuf_get_string(&lexer->linebuf))
-		>= strbuf_strlen(&lexer->linebuf);
-}
-
 struct token *lexer_lex_pp_number(struct lexer *lexer, struct token *token)
 {
+	char *end;
 	char c;
+	bool had_ucn = false;
 
 	strbuf_reset(&lexer->strbuf);
 
 	while (!lexer_is_eol(lexer)) {
+		end = scanner->number_end(lexer->c, lexer->line_end);
+		strbuf_putn(&lexer->strbuf, lexer->c, end - lexer->c);
+		lexer->c = end;
+
+		if (lexer_is_eol(lexer))
+			break;
+
 		if (*lexer->c == '+' || *lexer->c == '-') {
 			/* assert(not at the BOL) */
-			assert(lexer->c != strbuf_get_string(&lexer->linebuf));
+			assert(lexer->c != lexer->line);
 
 			c = lexer->c[-1];
 			if (c != 'e' && c != 'E' && c != 'p' && c != 'P')
 				break;
-		}
-		else if (*lexer->c == '\\') {
-			if (lexer->c[1] == 'u' || lexer->c[1] == 'U') {
-				lexer->c++;
-				strbuf_putwc(&lexer->strbuf, lexer_read_ucn(lexer));
-				continue;
-			}
-			else {
-				break;
-			}
 
+			strbuf_putc(&lexer->strbuf, *lexer->c);
+			lexer->c++;
 		}
-		else if (!is_digit(*lexer->c) && !is_ascii_letter(*lexer->c) && *lexer->c != '.' && *lexer->c != '_') {
+		else if (*lexer->c == '\\' && (lexer->c[1] == 'u' || lexer->c[1] == 'U')) {
+			lexer->c++;
+			strbuf_putwc(&lexer->strbuf, lexer_read_ucn(lexer));
+			had_ucn = true;
+		}
+		else {
 			break;
 		}
-
-		strbuf_putc(&lexer->strbuf, *lexer->c);
-		lexer->c++;
 	}
 
 	token->type = TOKEN_NUMBER;
-	token->str = strbuf_copy_to_mempool(&lexer->strbuf, &lexer->ctx->token_data);
-	token->spelling = lexer_spelling_end(lexer);
+	token->str = strbuf_copy_to_mempool(&lexer->strbuf, lexer->token_data);
+
+	/* unless there were UCNs, the spelling and the value are the same */
+	if (had_ucn)
+		token->spelling = lexer_spelling_end(lexer);
+	else
+		token->spelling = token->str;
 
 	return token;
 }
@@ -437,8 +494,9 @@ struct token *lexer_lex_string_literal(struct lexer *lexer, struct token *token)
 		lexer_error(lexer, "missing the final \"");
 
 	token->type = TOKEN_STRING_LITERAL;
-	token->lstr.str = strbuf_copy_to_mempool(&lexer->strbuf, &lexer->ctx->token_data);
-	token->lstr.len = strbuf_strlen(&lexer->strbuf);
+	token->lstr = mempool_alloc(lexer->token_data, sizeof(*token->lstr));
+	token->lstr->str = strbuf_copy_to_mempool(&lexer->strbuf, lexer->token_data);
+	token->lstr->len = strbuf_strlen(&lexer->strbuf);
 	token->spelling = lexer_spelling_end(lexer);
 
 	return token;
@@ -451,7 +509,7 @@ struct token *lexer_lex_header_name(struct lexer *lexer, struct token *token, bo
 
 	strbuf_reset(&lexer->strbuf);
 
-	while ((c = *lexer->c++) != '\0') {
+	while (!lexer_is_eol(lexer) && (c = *lexer->c++) != '\0') {
 		if (c == delim) {
 			seen_delim = true;
 			break;
@@ -470,7 +528,7 @@ struct token *lexer_lex_header_name(struct lexer *lexer, struct token *token, bo
 
 	// TODO Check (and warn about) presence of // and /* comments within header name
 
-	token->str = strbuf_copy_to_mempool(&lexer->strbuf, &lexer->ctx->token_data);
+	token->str = strbuf_copy_to_mempool(&lexer->strbuf, lexer->token_data);
 	token->spelling = lexer_spelling_end(lexer);
 
 	return token;
@@ -490,6 +548,56 @@ struct token *lexer_lex_header_qname(struct lexer *lexer, struct token *token)
 	return token;
 }
 
+/*
+ * Does the physical line [@start, @nl) need any rewriting in translation
+ * phases 1 and 2? That's the case when it contains a trigraph sequence or
+ * a backslash which `lexer_read_line' would treat as a line splice.
+ *
+ * The test is conservative: it may say yes even if the line would be copied
+ * verbatim, but never the other way round.
+ */
+static bool line_needs_rewriting(char *start, char *nl)
+{
+	char *p;
+
+	for (p = memchr(start, '\\', nl - start); p; p = memchr(p + 1, '\\', nl - p - 1))
+		if (is_whitespace(p[1]) || p[1] == '\v' || p[1] == '\n' || p[1] == '?')
+			return true;
+
+	for (p = memchr(start, '?', nl - start); p; p = memchr(p + 1, '?', nl - p - 1))
+		if (p[1] == '?')
+			return true;
+
+	return false;
+}
+
+/*
+ * Try to set up the next logical line in place, right within the input
+ * buffer, without copying it to `linebuf'. This is possible when the line
+ * ends with a newline within the buffered input (the newline then serves as
+ * a sentinel) and it doesn't need any phase 1 and 2 rewriting. That's the
+ * case for the vast majority of lines.
+ */
+static bool lexer_read_clean_line(struct lexer *lexer)
+{
+	struct inbuf *inbuf = lexer->inbuf;
+	char *start;
+	char *nl;
+
+	start = inbuf->data + inbuf->offset;
+	nl = memchr(start, '\n', inbuf->count - inbuf->offset);
+
+	if (!nl || line_needs_rewriting(start, nl))
+		return false;
+
+	inbuf->offset += nl - start + 1;
+
+	lexer->line = start;
+	lexer->line_end = nl;
+
+	return true;
+}
+
 /*
  * TODO Refactor, don't use mcc_error_t to signalize EOF
  */
@@ -498,6 +606,10 @@ static mcc_error_t lexer_read_line(struct lexer *lexer)
 	int c;
 	bool escape = false;
 	size_t num_qmarks = 0;	/* number of consecutive question-marks '?' */
+	size_t line_offset = lexer->inbuf->offset;
+
+	if (lexer_read_clean_line(lexer))
+		goto next_line;
 
 	strbuf_reset(&lexer->linebuf);
 
@@ -571,26 +683,30 @@ static mcc_error_t lexer_read_line(struct lexer *lexer)
 		return MCC_ERROR_EOF;
 
 eol_or_eof:
-	lexer->c = strbuf_get_string(&lexer->linebuf);
-	lexer->location.line_no++;
-	lexer->location.column_no = 0;
+	lexer->line = strbuf_get_string(&lexer->linebuf);
+	lexer->line_end = lexer->line + strbuf_strlen(&lexer->linebuf);
+
+next_line:
+	lexer->c = lexer->line;
+	if (lexer->base != SRCLOC_NONE)
+		lexer->line_loc = lexer->base + line_offset;
 
 	return MCC_ERROR_OK;
 }
 
 static inline void eat_whitespace(struct lexer *lexer)
 {
-	while (is_whitespace(*lexer->c)) {
+	char *end = scanner->white_end(lexer->c, lexer->line_end);
+
+	if (end != lexer->c) {
 		lexer->had_whitespace = true;
-		lexer->c++;
+		lexer->c = end;
 	}
 }
 
 void eat_cpp_comment(struct lexer *lexer)
 {
-	while (!lexer_is_eol(lexer)) {
-		lexer->c++;
-	}
+	lexer->c = lexer->line_end;
 }
 
 void eat_c_comment(struct lexer *lexer)
@@ -598,13 +714,10 @@ void eat_c_comment(struct lexer *lexer)
 	assert(lexer->c[-2] == '/' && lexer->c[-1] == '*');
 
 search_comment_terminator:
-	while (!lexer_is_eol(lexer)) {
-		if (*lexer->c == '*' && lexer->c[1] == '/') {
-			lexer->c += 2;
-			return;
-		}
-
-		lexer->c++;
+	lexer->c = scanner->comment_end(lexer->c, lexer->line_end);
+	if (!lexer_is_eol(lexer)) {
+		lexer->c += 2;
+		return;
 	}
 
 	if (lexer_read_line(lexer) != MCC_ERROR_EOF)
@@ -657,16 +770,13 @@ next_nonwhite_char:
 	token->is_at_bol = lexer->next_at_bol;
 	token->after_white = lexer->had_whitespace;
 	token->noexpand = false;
+	token->is_scratch = false;
 	token->enc_prefix = ENC_PREFIX_NONE;
 
 	lexer->next_at_bol = false;
 	lexer->had_whitespace = false;
 
-	/* TODO unhack this */
-	lexer->location.column_no = lexer->c - strbuf_get_string(&lexer->linebuf);
-	token->startloc = lexer->location;
-	/* TODO unhack this */
-	token->startloc.filename = lexer->filename;
+	token->loc = lexer_loc(lexer);
 
 	lexer_spelling_start(lexer);
 
@@ -1022,6 +1132,7 @@ next_nonwhite_char:
 
 	case '\\':
 		if (*lexer->c == 'u' || *lexer->c == 'U') {
+			lexer->c--;
 			lexer_lex_name(lexer, token);
 			return;
 		}
@@ -1031,6 +1142,180 @@ next_nonwhite_char:
 	default:
 		token->type = TOKEN_OTHER;
 		token->value = lexer->c[-1];
-		token->spelling = lexer_spelling_end(lexer);
+		token->spelling = lexer_one_char_spelling(lexer->c[-1]);
+	}
+}
+
+/*
+ * Skip the rest of the comment which started before @p within [@p, @end).
+ * Clear @in_comment if it ends there.
+ */
+static char *skip_comment_rest(char *p, char *end, bool *in_comment)
+{
+	p = scanner->comment_end(p, end);
+	if (p >= end)
+		return end;
+
+	*in_comment = false;
+	return p + 2;
+}
+
+/*
+ * Skip whitespace and comments within [@p, @end). Set @in_comment if there's
+ * a comment which doesn't end there.
+ */
+static char *skip_blanks(char *p, char *end, bool *in_comment)
+{
+	while (p < end) {
+		if (*in_comment) {
+			p = skip_comment_rest(p, end, in_comment);
+		}
+		else if (is_whitespace(*p)) {
+			p++;
+		}
+		else if (*p == '/' && p + 1 < end && p[1] == '*') {
+			p += 2;
+			*in_comment = true;
+		}
+		else if (*p == '/' && p + 1 < end && p[1] == '/') {
+			return end;
+		}
+		else {
+			break;
+		}
 	}
+
+	return p;
+}
+
+/*
+ * Skip the text within [@p, @end), keeping track of comments in @in_comment.
+ * Quotes are skipped too, since they may contain comment delimiters; they
+ * needn't be terminated within skipped lines.
+ */
+static void skip_text(char *p, char *end, bool *in_comment)
+{
+	char quote;
+
+	while (p < end) {
+		if (*in_comment) {
+			p = skip_comment_rest(p, end, in_comment);
+			continue;
+		}
+
+		switch (*p++) {
+		case '/':
+			if (p < end && *p == '*') {
+				p++;
+				*in_comment = true;
+			}
+			else if (p < end && *p == '/') {
+				return;
+			}
+			break;
+
+		case '\"':
+		case '\'':
+			quote = p[-1];
+			while (p < end && *p != quote)
+				p += (*p == '\\') ? 2 : 1;
+			p++;
+			break;
+		}
+	}
+}
+
+/*
+ * Conditional directives, as far as the nesting of groups is concerned.
+ */
+enum skip_directive
+{
+	SKIP_DIRECTIVE_OTHER,		/* not a conditional directive */
+	SKIP_DIRECTIVE_IF,		/* #if, #ifdef, #ifndef */
+	SKIP_DIRECTIVE_ELSE,		/* #elif, #else */
+	SKIP_DIRECTIVE_ENDIF,		/* #endif */
+};
+
+static enum skip_directive get_skip_directive(char *name, size_t len)
+{
+	if ((len == 2 && !memcmp(name, "if", 2))
+		|| (len == 5 && !memcmp(name, "ifdef", 5))
+		|| (len == 6 && !memcmp(name, "ifndef", 6)))
+		return SKIP_DIRECTIVE_IF;
+
+	if ((len == 4 && !memcmp(name, "elif", 4))
+		|| (len == 4 && !memcmp(name, "else", 4)))
+		return SKIP_DIRECTIVE_ELSE;
+
+	if (len == 5 && !memcmp(name, "endif", 5))
+		return SKIP_DIRECTIVE_ENDIF;
+
+	return SKIP_DIRECTIVE_OTHER;
+}
+
+/*
+ * Skip the rest of a conditional group which isn't processed, without
+ * lexing it: no tokens are produced, names aren't looked up and nothing is
+ * copied. Lines are only checked for the conditional directives, to keep
+ * track of the nesting, and for comments and quotes, which may hide
+ * directives. Stop at the beginning of the line with the #elif, #else or
+ * #endif which ends the group (or at the end of input), so that the
+ * directive is lexed next.
+ *
+ * This is only possible at the end of a line. If there's anything but
+ * whitespace and comments left on the current line, nothing is skipped and
+ * false is returned; the caller should lex the rest of the line as usual.
+ */
+bool lexer_skip_group(struct lexer *lexer)
+{
+	enum skip_directive dir;
+	size_t line_offset;
+	unsigned depth = 0;
+	bool in_comment = false;
+	char *p, *name;
+
+	p = skip_blanks(lexer->c, lexer->line_end, &in_comment);
+	if (p < lexer->line_end || in_comment)
+		return false;
+
+	while (1) {
+		line_offset = lexer->inbuf->offset;
+		if (lexer_read_line(lexer) == MCC_ERROR_EOF)
+			break;
+
+		/* a `#' which follows a comment from previous lines isn't at BOL */
+		if (in_comment) {
+			skip_text(lexer->line, lexer->line_end, &in_comment);
+			continue;
+		}
+
+		/* like `lexer_next', only take a `#' after whitespace for BOL */
+		p = scanner->white_end(lexer->line, lexer->line_end);
+		if (p < lexer->line_end && (*p == '#'
+			|| (*p == '%' && p + 1 < lexer->line_end && p[1] == ':'))) {
+			p = skip_blanks(p + (*p == '#' ? 1 : 2), lexer->line_end, &in_comment);
+			name = p;
+			p = scanner->name_end(p, lexer->line_end);
+			dir = get_skip_directive(name, p - name);
+
+			if (dir == SKIP_DIRECTIVE_IF) {
+				depth++;
+			}
+			else if (dir != SKIP_DIRECTIVE_OTHER && depth == 0) {
+				/* give the line back */
+				lexer->inbuf->offset = line_offset;
+				lexer->c = lexer->line_end;
+				break;
+			}
+			else if (dir == SKIP_DIRECTIVE_ENDIF) {
+				depth--;
+			}
+		}
+
+		skip_text(p, lexer->line_end, &in_comment);
+	}
+
+	lexer->next_at_bol = true;
+	lexer->had_whitespace = false;
+	return true;
 }
@@ -36,10 +36,15 @@ void *array_new(size_t init_capacity, size_t item_size)
 void *array_claim(void *arr, size_t num_items)
 {
 	struct array_header *header;
+	size_t new_capacity;
 
 	header = array_get_header(arr);
 	if (header->num_items + num_items > header->capacity) {
-		arr = array_resize(arr, 2 * header->capacity, header->item_size);
+		new_capacity = MAX(header->capacity, 1);
+		while (header->num_items + num_items > new_capacity)
+			new_capacity *= 2;
+
+		arr = array_resize(arr, new_capacity, header->item_size);
 		header = array_get_header(arr);
 	}
 
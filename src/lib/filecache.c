@@ -0,0 +1,117 @@
+#include "array.h"
+#include "common.h"
+#include "debug.h"
+#include "filecache.h"
+#include <string.h>
+
+#define ENTRY_POOL_BLOCK_SIZE	64
+#define ENTRIES_INIT_SIZE	64
+#define READ_BLOCK_SIZE		2048
+
+/*
+ * Key of an entry. It's hashed as a byte string, so it's zeroed before
+ * being filled in to have any padding well-defined.
+ */
+struct filecache_key
+{
+	dev_t dev;
+	ino_t ino;
+};
+
+void filecache_init(struct filecache *cache)
+{
+	objpool_init(&cache->entry_pool, sizeof(struct filecache_entry), ENTRY_POOL_BLOCK_SIZE);
+	hashtab_init(&cache->entries, &cache->entry_pool, ENTRIES_INIT_SIZE);
+	cache->contents = array_new(ENTRIES_INIT_SIZE, sizeof(*cache->contents));
+	pthread_mutex_init(&cache->lock, NULL);
+}
+
+void filecache_free(struct filecache *cache)
+{
+	size_t i;
+
+	for (i = 0; i < array_size(cache->contents); i++)
+		inbuf_close(&cache->contents[i]);
+
+	array_delete(cache->contents);
+	hashtab_free(&cache->entries);
+	objpool_free(&cache->entry_pool);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+/*
+ * Load the contents of the file @filename into @entry.
+ */
+static mcc_error_t entry_load(struct filecache *cache, struct filecache_entry *entry,
+	const char *filename, struct stat *st)
+{
+	struct inbuf contents;
+	mcc_error_t err;
+
+	err = inbuf_open(&contents, READ_BLOCK_SIZE, filename);
+	if (err != MCC_ERROR_OK)
+		return err;
+
+	array_push(cache->contents, contents);
+
+	entry->data = contents.data;
+	entry->count = contents.count;
+	entry->mtime = st->st_mtim;
+	entry->size = st->st_size;
+
+	return MCC_ERROR_OK;
+}
+
+static bool entry_is_fresh(struct filecache_entry *entry, struct stat *st)
+{
+	return entry->size == st->st_size
+		&& entry->mtime.tv_sec == st->st_mtim.tv_sec
+		&& entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Open the file @filename for reading through @inbuf. If the file is a
+ * regular file, its contents are loaded into the cache (unless they're there
+ * already) and @inbuf reads them from there. Other files (pipes, terminals)
+ * bypass the cache. Either way, @inbuf should be closed with `inbuf_close'.
+ */
+mcc_error_t filecache_open(struct filecache *cache, const char *filename, struct inbuf *inbuf)
+{
+	struct filecache_entry *entry;
+	struct filecache_key key;
+	struct stat st;
+	mcc_error_t err;
+
+	if (stat(filename, &st) != 0)
+		return MCC_ERROR_ACCESS; /* TODO Error reporting */
+
+	if (!S_ISREG(st.st_mode))
+		return inbuf_open(inbuf, READ_BLOCK_SIZE, filename);
+
+	memset(&key, 0, sizeof(key));
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+
+	pthread_mutex_lock(&cache->lock);
+
+	entry = hashtab_search(&cache->entries, (char *)&key, sizeof(key));
+	if (!entry) {
+		entry = objpool_alloc(&cache->entry_pool);
+		if ((err = entry_load(cache, entry, filename, &st)) != MCC_ERROR_OK) {
+			objpool_dealloc(&cache->entry_pool, entry);
+			goto out_unlock;
+		}
+		hashtab_insert(&cache->entries, (char *)&key, sizeof(key), &entry->hashnode);
+	}
+	else if (!entry_is_fresh(entry, &st)) {
+		DEBUG_PRINTF("Reloading %s", filename);
+		if ((err = entry_load(cache, entry, filename, &st)) != MCC_ERROR_OK)
+			goto out_unlock;
+	}
+
+	err = inbuf_open_mem(inbuf, entry->data, entry->count);
+
+out_unlock:
+	pthread_mutex_unlock(&cache->lock);
+	return err;
+}
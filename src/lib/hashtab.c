@@ -1,116 +1,205 @@
+#include "common.h"
 #include "debug.h"
 #include "hashtab.h"
 #include <assert.h>
 #include <inttypes.h>
 #include <string.h>
+#include <sys/types.h>
 
 /*
- * TODO Use of this hashing function is not backed up by any analysis of its
- *      performance. Measure and, if necessary, improve the function.
- *
- * Taken from http://www.cse.yorku.ca/~oz/hash.html#sdbm.
+ * Maximum load factor of the table is HASHTAB_MAX_LOAD_NUM/HASHTAB_MAX_LOAD_DEN.
+ * Robin Hood probing keeps the probe sequences short even at high load.
  */
-static inline uint64_t hashtab_hash(char *key)
-{
-	uint64_t hash = 0;
-	int c;
+#define HASHTAB_MAX_LOAD_NUM	7
+#define HASHTAB_MAX_LOAD_DEN	8
 
-	while ((c = *key++))
-		hash = c + (hash << 6) + (hash << 16) - hash;
+#define HASHTAB_MIN_SIZE	16
 
-	return hash;
+static inline size_t hashtab_mask(struct hashtab *hashtab)
+{
+	return hashtab->size - 1;
 }
 
-static void hashtab_insert_internal(struct hashtab *hashtab, struct hashnode *new_node)
+/*
+ * Distance of the slot at index @i from the ideal slot of its key.
+ */
+static inline size_t hashtab_dist(struct hashtab *hashtab, size_t i)
 {
-	uint64_t hash = hashtab_hash(new_node->key) % hashtab->size;
-	struct hashnode *node;
-	
-	node = &hashtab->table[hash];
-	new_node->next = node->next;
-	node->next = new_node;
+	return (i - hashtab->slots[i].hash) & hashtab_mask(hashtab);
+}
+
+/*
+ * Place @slot into the table. Robin Hood: whenever the probed slot is closer
+ * to its ideal position than the slot being placed, the two are swapped and
+ * the displaced slot is placed instead. This keeps the variance of probe
+ * lengths low, and lets unsuccessful searches stop early.
+ */
+static void hashtab_place(struct hashtab *hashtab, struct hashslot slot)
+{
+	size_t mask = hashtab_mask(hashtab);
+	size_t i = slot.hash & mask;
+	size_t dist = 0;
+	size_t cur_dist;
+	struct hashslot tmp;
+
+	while (hashtab->slots[i].node) {
+		cur_dist = hashtab_dist(hashtab, i);
+		if (cur_dist < dist) {
+			tmp = hashtab->slots[i];
+			hashtab->slots[i] = slot;
+			slot = tmp;
+			dist = cur_dist;
+		}
+
+		i = (i + 1) & mask;
+		dist++;
+	}
+
+	hashtab->slots[i] = slot;
 }
 
 static void hashtab_resize(struct hashtab *hashtab, size_t new_size)
 {
-	struct hashnode *old_table;
+	struct hashslot *old_slots;
 	size_t old_size;
-	struct hashnode *node, *tmp_node;
 	size_t i;
 
-	old_table = hashtab->table;
+	assert((new_size & (new_size - 1)) == 0);
+	assert(new_size > hashtab->count);
+
+	old_slots = hashtab->slots;
 	old_size = hashtab->size;
 
-	hashtab->table = calloc(new_size, sizeof(*hashtab->table));
+	hashtab->slots = mcc_malloc(new_size * sizeof(*hashtab->slots));
+	memset(hashtab->slots, 0, new_size * sizeof(*hashtab->slots));
 	hashtab->size = new_size;
 
-	for (i = 0; i < old_size; i++) {
-		node = old_table[i].next;
+	for (i = 0; i < old_size; i++)
+		if (old_slots[i].node)
+			hashtab_place(hashtab, old_slots[i]);
 
-		while (node) {
-			tmp_node = node->next;
-			hashtab_insert_internal(hashtab, node);
-			node = tmp_node;
-		}
-	}
+	free(old_slots);
 
-	free(old_table);
+	DEBUG_PRINTF("Resized hashtab to %zu slots", new_size);
 }
 
 void hashtab_init(struct hashtab *hashtab, struct objpool *pool, size_t init_size)
 {
 	(void) pool; /* TODO why unused? */
 
-	hashtab->table = NULL;
+	size_t size = HASHTAB_MIN_SIZE;
+
+	while (size < init_size)
+		size *= 2;
+
+	hashtab->slots = NULL;
 	hashtab->size = 0;
 	hashtab->count = 0;
 	mempool_init(&hashtab->keys, 1024);
-	hashtab_resize(hashtab, init_size);
+	hashtab_resize(hashtab, size);
 }
 
 void hashtab_free(struct hashtab *hashtab)
 {
 	mempool_free(&hashtab->keys);
-	free(hashtab->table);
+	free(hashtab->slots);
+}
+
+/*
+ * Find the index of the slot which holds @key of length @len with hash
+ * @hash. Return -1 if @key isn't in the table.
+ */
+static ssize_t hashtab_find(struct hashtab *hashtab, char *key, size_t len, uint32_t hash)
+{
+	size_t mask = hashtab_mask(hashtab);
+	size_t i = hash & mask;
+	size_t dist;
+	struct hashslot *slot;
+
+	for (dist = 0;; dist++, i = (i + 1) & mask) {
+		slot = &hashtab->slots[i];
+
+		/* @key would have displaced a slot this close to its ideal one */
+		if (!slot->node || hashtab_dist(hashtab, i) < dist)
+			return -1;
+
+		if (slot->hash == hash && slot->len == len
+			&& memcmp(slot->node->key, key, len) == 0)
+			return i;
+	}
 }
 
-void *hashtab_insert(struct hashtab *hashtab, char *key, struct hashnode *node)
+/*
+ * Insert @node under @key of length @len. The key is copied. The key must not
+ * be present in the table.
+ */
+void *hashtab_insert(struct hashtab *hashtab, char *key, size_t len, struct hashnode *node)
+{
+	return hashtab_insert_hash(hashtab, key, len, hashtab_hash(key, len), node);
+}
+
+/*
+ * Same as `hashtab_insert', but @hash is the `hashtab_hash' of @key.
+ */
+void *hashtab_insert_hash(struct hashtab *hashtab, char *key, size_t len, uint32_t hash,
+	struct hashnode *node)
+{
+	return hashtab_insert_nocopy(hashtab, mempool_strndup(&hashtab->keys, key, len), len,
+		hash, node);
+}
+
+/*
+ * Same as `hashtab_insert_hash', but @key isn't copied: it must be
+ * NUL-terminated and stay valid for as long as @node is in the table.
+ */
+void *hashtab_insert_nocopy(struct hashtab *hashtab, char *key, size_t len, uint32_t hash,
+	struct hashnode *node)
 {
-	float load;
-	char *key_copy;
-	size_t key_len;
+	struct hashslot slot;
 
-	load = hashtab->count / hashtab->size;
-	if (load > 0.5)
+	assert(len <= UINT32_MAX);
+	assert(hash == hashtab_hash(key, len));
+	assert(!hashtab_contains(hashtab, key, len));
+
+	if ((hashtab->count + 1) * HASHTAB_MAX_LOAD_DEN > hashtab->size * HASHTAB_MAX_LOAD_NUM)
 		hashtab_resize(hashtab, 2 * hashtab->size);
 
-	key_len = strlen(key);
-	key_copy = mempool_alloc(&hashtab->keys, key_len + 1);
-	strncpy(key_copy, key, key_len + 1);
+	node->key = key;
+	node->len = len;
 
-	node->key = key_copy;
+	slot.hash = hash;
+	slot.len = len;
+	slot.node = node;
 
-	hashtab_insert_internal(hashtab, node);
+	hashtab_place(hashtab, slot);
 	hashtab->count++;
 
 	return node;
 }
 
+/*
+ * Remove @node from the table. Slots which follow the removed one are
+ * shifted back, so that no tombstones are needed.
+ */
 bool hashtab_remove(struct hashtab *hashtab, struct hashnode *node)
 {
-	uint64_t hash;
-	struct hashnode *cur;
-
-	hash = hashtab_hash(node->key);
+	size_t mask = hashtab_mask(hashtab);
+	ssize_t found;
+	size_t i, next;
 
-	cur = &hashtab->table[hash];
-	while (cur && cur->next != node)
-		cur = cur->next;
-
-	if (cur->next != node)
+	found = hashtab_find(hashtab, node->key, node->len, hashtab_hash(node->key, node->len));
+	if (found < 0 || hashtab->slots[found].node != node)
 		return false;
 
-	cur->next = node->next;
+	i = found;
+	next = (i + 1) & mask;
+	while (hashtab->slots[next].node && hashtab_dist(hashtab, next) > 0) {
+		hashtab->slots[i] = hashtab->slots[next];
+		i = next;
+		next = (next + 1) & mask;
+	}
+
+	hashtab->slots[i].node = NULL;
 
 	assert(hashtab->count > 0);
 	hashtab->count--;
@@ -123,35 +212,28 @@ size_t hashtab_count(struct hashtab *hashtab)
 	return hashtab->count;
 }
 
-bool hashtab_contains(struct hashtab *hashtab, char *key)
+bool hashtab_contains(struct hashtab *hashtab, char *key, size_t len)
 {
-	return hashtab_search(hashtab, key) != NULL;
+	return hashtab_search(hashtab, key, len) != NULL;
 }
 
-void *hashtab_search(struct hashtab *hashtab, char *key)
+void *hashtab_search(struct hashtab *hashtab, char *key, size_t len)
 {
-	uint64_t hash;
-	struct hashnode *node;
-
-	hash = hashtab_hash(key) % hashtab->size;
-	node = &hashtab->table[hash];
-	node->key = key; /* used by hashtab_next */
-
-	return hashtab_next(hashtab, node);
+	return hashtab_search_hash(hashtab, key, len, hashtab_hash(key, len));
 }
 
-void *hashtab_next(struct hashtab *hashtab, struct hashnode *node)
+/*
+ * Same as `hashtab_search', but @hash is the `hashtab_hash' of @key.
+ */
+void *hashtab_search_hash(struct hashtab *hashtab, char *key, size_t len, uint32_t hash)
 {
-	(void) hashtab;
-
-	struct hashnode *cur = node->next;
+	ssize_t i;
 
-	while (cur != NULL) {
-		if (strcmp(cur->key, node->key) == 0)
-			return cur;
+	assert(hash == hashtab_hash(key, len));
 
-		cur = cur->next;
-	}
+	i = hashtab_find(hashtab, key, len, hash);
+	if (i < 0)
+		return NULL;
 
-	return NULL;
+	return hashtab->slots[i].node;
 }
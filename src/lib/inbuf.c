@@ -2,65 +2,115 @@
 #include "inbuf.h"
 #include "debug.h"
 #include <assert.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static void inbuf_fill(struct inbuf *buf)
+/*
+ * Read the file open as @fd into memory as a whole, in chunks of (at least)
+ * @size bytes. This is used for inputs which can't be mapped.
+ */
+static mcc_error_t inbuf_open_read(struct inbuf *buf, size_t size, int fd)
 {
-	buf->count = fread(buf->data, sizeof(char), buf->size, buf->file);
-	buf->offset = 0;
-}
+	ssize_t len;
 
-static void inbuf_open_internal(struct inbuf *buf, size_t size, FILE *file)
-{
 	assert(size > 0);
 
-	buf->file = file;
+	buf->mode = INBUF_MODE_READ;
 	buf->size = size;
 	buf->count = 0;
 	buf->offset = 0;
-
 	buf->data = mcc_malloc(buf->size);
+
+	while ((len = read(fd, buf->data + buf->count, buf->size - buf->count)) != 0) {
+		if (len < 0) {
+			free(buf->data);
+			return MCC_ERROR_ACCESS;
+		}
+
+		buf->count += len;
+		if (buf->count == buf->size) {
+			buf->size *= 2;
+			buf->data = mcc_realloc(buf->data, buf->size);
+		}
+	}
+
+	return MCC_ERROR_OK;
 }
 
-mcc_error_t inbuf_open(struct inbuf *buf, size_t size, const char *filename)
+/*
+ * Try to map the file open as @fd into memory. This only works for non-empty
+ * regular files; for anything else (pipes, terminals), return false and let
+ * the caller read the input instead.
+ */
+static bool inbuf_open_mmap(struct inbuf *buf, int fd)
 {
-	FILE *file;
-	
-	file = fopen(filename, "r");
-	if (!file)
-		return MCC_ERROR_ACCESS; /* TODO Error reporting */
+	struct stat st;
+	void *data;
 
-	inbuf_open_internal(buf, size, file);
-	return MCC_ERROR_OK;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return false;
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return false;
+
+	DEBUG_PRINTF("Mapped %zu B at %p", (size_t)st.st_size, data);
+
+	buf->mode = INBUF_MODE_MMAP;
+	buf->data = data;
+	buf->size = st.st_size;
+	buf->count = st.st_size;
+	buf->offset = 0;
+
+	return true;
 }
 
-mcc_error_t inbuf_open_mem(struct inbuf *buf, char *str, size_t len)
+/*
+ * Open the file @filename. @size is the size of the chunks in which the
+ * file is read if it can't be mapped.
+ */
+mcc_error_t inbuf_open(struct inbuf *buf, size_t size, const char *filename)
 {
-	FILE *file;
-	
-	file = fmemopen(str, len, "r");
-	if (!file)
+	mcc_error_t err = MCC_ERROR_OK;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
 		return MCC_ERROR_ACCESS; /* TODO Error reporting */
 
-	inbuf_open_internal(buf, len, file);
-	return MCC_ERROR_OK;
-}
+	if (!inbuf_open_mmap(buf, fd))
+		err = inbuf_open_read(buf, size, fd);
 
-int inbuf_get_char(struct inbuf *buf)
-{		
-	if (buf->offset == buf->count)
-		inbuf_fill(buf);
+	close(fd); /* a mapping stays valid */
+	return err;
+}
 
-	if (buf->count == 0)
-		return INBUF_EOF;
+mcc_error_t inbuf_open_mem(struct inbuf *buf, char *str, size_t len)
+{
+	buf->mode = INBUF_MODE_MEM;
+	buf->data = str;
+	buf->size = len;
+	buf->count = len;
+	buf->offset = 0;
 
-	return buf->data[buf->offset++];
+	return MCC_ERROR_OK;
 }
 
 void inbuf_close(struct inbuf *buf)
 {
-	assert(buf->file != NULL);
+	switch (buf->mode) {
+	case INBUF_MODE_READ:
+		free(buf->data);
+		break;
+
+	case INBUF_MODE_MMAP:
+		munmap(buf->data, buf->size);
+		break;
 
-	free(buf->data);
-	fclose(buf->file);
+	case INBUF_MODE_MEM:
+		break;
+	}
 }
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 
 #define ARRAY_SIZE(arr)		(sizeof(arr) / sizeof(*(arr)))
+#define MAX(a, b)		((a) > (b) ? (a) : (b))
+#define MIN(a, b)		((a) < (b) ? (a) : (b))
 
 typedef unsigned char	byte_t;
 
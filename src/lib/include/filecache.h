@@ -0,0 +1,54 @@
+/*
+ * filecache:
+ * Cache of file contents. Each file is brought into memory (mapped or read)
+ * only once, however many times it's opened; readers get an `inbuf' of their
+ * own (INBUF_MODE_MEM) over the shared contents, i.e. just a cursor.
+ *
+ * Files are identified by device and inode, so that all paths which lead to
+ * a file share its contents. The contents are reloaded if the modification
+ * time or the size of the file changes. All contents, including those which
+ * were replaced that way, are kept until the cache is freed, since readers
+ * may still use them.
+ *
+ * The cache may be shared by several threads; `filecache_open' serializes
+ * the lookups and loads, and the contents are never written once loaded.
+ */
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include "error.h"
+#include "hashtab.h"
+#include "inbuf.h"
+#include "objpool.h"
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Cached contents of a single file.
+ */
+struct filecache_entry
+{
+	struct hashnode hashnode;	/* allows entries to be hashed by dev and inode */
+	char *data;			/* contents of the file */
+	size_t count;			/* length of @data */
+	struct timespec mtime;		/* modification time when loaded */
+	off_t size;			/* size when loaded */
+};
+
+struct filecache
+{
+	struct objpool entry_pool;	/* objpool for the entries */
+	struct hashtab entries;		/* entries by device and inode */
+	struct inbuf *contents;		/* all loaded contents (array.h) */
+	pthread_mutex_t lock;		/* protects all of the above */
+};
+
+void filecache_init(struct filecache *cache);
+void filecache_free(struct filecache *cache);
+
+mcc_error_t filecache_open(struct filecache *cache, const char *filename, struct inbuf *inbuf);
+
+#endif
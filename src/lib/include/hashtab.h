@@ -1,6 +1,12 @@
 /*
  * hashtab:
- * Simple hashtable.
+ * Open-addressing hash table with Robin Hood probing.
+ *
+ * Keys are (pointer, length) pairs, they needn't be NUL-terminated. The table
+ * keeps a NUL-terminated copy of each inserted key, unless the key is known
+ * to outlive the node (see `hashtab_insert_nocopy'). Each slot stores the hash
+ * and the length of its key next to the node pointer, so that most probes
+ * are resolved without touching the node or the key.
  */
 
 #ifndef HASHTAB_H
@@ -8,15 +14,24 @@
 
 #include "objpool.h"
 #include "mempool.h"
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+
+struct hashslot
+{
+	uint32_t hash;			/* (truncated) hash of the key */
+	uint32_t len;			/* length of the key */
+	struct hashnode *node;		/* node, NULL if the slot is empty */
+};
 
 struct hashtab
 {
-	struct hashnode *table;
-	struct mempool keys;
-	size_t count;
-	size_t size;
+	struct hashslot *slots;		/* array of @size slots */
+	struct mempool keys;		/* copies of the keys */
+	size_t count;			/* number of nodes in the table */
+	size_t size;			/* number of slots (a power of two) */
 };
 
 void hashtab_init(struct hashtab *table, struct objpool *pool, size_t init_size);
@@ -24,17 +39,97 @@ void hashtab_free(struct hashtab *table);
 
 size_t hashtab_count(struct hashtab *table);
 
-void *hashtab_insert(struct hashtab *table, char *key, struct hashnode *node);
+void *hashtab_insert(struct hashtab *table, char *key, size_t len, struct hashnode *node);
+void *hashtab_insert_hash(struct hashtab *table, char *key, size_t len, uint32_t hash,
+	struct hashnode *node);
+void *hashtab_insert_nocopy(struct hashtab *table, char *key, size_t len, uint32_t hash,
+	struct hashnode *node);
 bool hashtab_remove(struct hashtab *table, struct hashnode *node);
 
-bool hashtab_contains(struct hashtab *table, char *key);
-void *hashtab_search(struct hashtab *table, char *key);
-void *hashtab_next(struct hashtab *table, struct hashnode *node);
+bool hashtab_contains(struct hashtab *table, char *key, size_t len);
+void *hashtab_search(struct hashtab *table, char *key, size_t len);
+void *hashtab_search_hash(struct hashtab *table, char *key, size_t len, uint32_t hash);
 
 struct hashnode
 {
-	char *key;
-	struct hashnode *next;
+	char *key;			/* NUL-terminated (copy of the) key */
+	size_t len;			/* length of the key */
 };
 
+#define HASHTAB_HASH_SEED	0x243f6a8885a308d3ULL
+#define HASHTAB_HASH_MUL	0x100000001b3ULL	/* the 64-bit FNV prime */
+
+static inline uint64_t hashtab_load64(const char *p)
+{
+	uint64_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+static inline uint64_t hashtab_load32(const char *p)
+{
+	uint32_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+/*
+ * Hash @len bytes at @key. This is FNV-1a, but the key is consumed a 64-bit
+ * word at a time rather than byte by byte. Keys of up to 16 bytes (nearly all
+ * identifiers) are read with two possibly overlapping loads from either end,
+ * which avoids a byte loop and most of the branches on the length. The words
+ * are only mixed by the multiplication, so the result is finalized with the
+ * MurmurHash3 `fmix64' avalanche to make all the bits usable.
+ *
+ * It's in the header so that callers which have the key at hand (the lexer)
+ * can have it inlined and pass the hash to the `*_hash' functions, which
+ * then don't hash the key again.
+ */
+static inline uint32_t hashtab_hash(const char *key, size_t len)
+{
+	const char *end = key + len;
+	uint64_t hash = HASHTAB_HASH_SEED ^ len;
+	uint64_t a, b;
+
+	if (len <= 16) {
+		if (len >= 8) {
+			a = hashtab_load64(key);
+			b = hashtab_load64(end - 8);
+		}
+		else if (len >= 4) {
+			a = hashtab_load32(key);
+			b = hashtab_load32(end - 4);
+		}
+		else if (len > 0) {
+			a = (uint64_t)(unsigned char)key[0] << 16
+				| (uint64_t)(unsigned char)key[len >> 1] << 8
+				| (unsigned char)end[-1];
+			b = 0;
+		}
+		else {
+			a = b = 0;
+		}
+	}
+	else {
+		for (; end - key > 16; key += 16) {
+			hash = (hash ^ hashtab_load64(key)) * HASHTAB_HASH_MUL;
+			hash = (hash ^ hashtab_load64(key + 8)) * HASHTAB_HASH_MUL;
+		}
+
+		a = hashtab_load64(end - 16);
+		b = hashtab_load64(end - 8);
+	}
+
+	hash = (hash ^ a) * HASHTAB_HASH_MUL;
+	hash = (hash ^ b) * HASHTAB_HASH_MUL;
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return (uint32_t)hash;
+}
+
 #endif
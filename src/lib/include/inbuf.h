@@ -1,13 +1,34 @@
+/*
+ * inbuf:
+ * Input buffer. The whole input is always available in memory: regular
+ * files are mapped, other inputs (pipes, terminals) are read in full.
+ */
+
 #ifndef INBUF_H
 #define INBUF_H
 
 #include "error.h"
+#include <stdbool.h>
 #include <stdio.h>
 
 #define INBUF_EOF	(-1)
 
+/*
+ * How the data is brought into the buffer.
+ */
+enum inbuf_mode
+{
+	INBUF_MODE_READ,	/* whole input read into a malloc'd @data */
+	INBUF_MODE_MMAP,	/* whole file mapped read-only to @data */
+	INBUF_MODE_MEM,		/* whole input given as a memory region */
+};
+
+/*
+ * `data[offset]' through `data[count - 1]' is the rest of the input, and it
+ * may be scanned in place.
+ */
 struct inbuf {
-	FILE *file;	/* file managed by this buffer */
+	enum inbuf_mode mode;	/* see enum inbuf_mode */
 	char *data;	/* buffered data */
 	size_t size;	/* size of the buffer */
 	size_t count;	/* number of bytes in the buffer */
@@ -18,6 +39,12 @@ mcc_error_t inbuf_open(struct inbuf *inbuf, size_t size, const char *filename);
 mcc_error_t inbuf_open_mem(struct inbuf *inbuf, char *string, size_t len);
 void inbuf_close(struct inbuf *inbuf);
 
-int inbuf_get_char(struct inbuf *inbuf);
+static inline int inbuf_get_char(struct inbuf *inbuf)
+{
+	if (inbuf->offset < inbuf->count)
+		return (unsigned char)inbuf->data[inbuf->offset++];
+
+	return INBUF_EOF;
+}
 
 #endif
@@ -0,0 +1,27 @@
+/*
+ * intern:
+ * Process-wide string interner. Each distinct string is stored once, for the
+ * lifetime of the process, and it gets a stable pointer and id. Two interned
+ * strings are equal if and only if they're the same pointer (or id), however
+ * many threads or contexts interned them.
+ *
+ * The strings are spread over shards by their hash, each with a lock and
+ * a hash table of its own, so threads interning different strings seldom
+ * contend for a lock.
+ */
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+typedef uint32_t intern_id_t;
+
+char *intern(const char *str, size_t len);
+char *intern_hash(const char *str, size_t len, uint32_t hash);
+
+intern_id_t intern_id(const char *istr);
+size_t intern_len(const char *istr);
+
+#endif
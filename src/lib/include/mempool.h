@@ -1,43 +1,65 @@
 /*
  * mempool:
  * Variable-size memory allocator without support for individual deallocation.
+ *
+ * Objects are bump-allocated from blocks, which grow geometrically from the
+ * block size given to `mempool_init'. Objects which are large compared to
+ * the blocks get blocks of their own. `mempool_alloc' returns memory aligned
+ * for any object, the string functions pack the strings without alignment.
+ *
+ * Memory can be released in bulk: all of it (`mempool_reset'), or all that
+ * was allocated after a mark was taken (`mempool_get_mark', `mempool_release').
+ * Released blocks are kept for later allocations from the pool, and once the
+ * pool is freed, they're kept in a process-wide cache for other pools.
  */
 
 #ifndef MEMPOOL_H
 #define MEMPOOL_H
 
+#include <stdalign.h>
+#include <stddef.h>
 #include <stdlib.h>
 
+#define MEMPOOL_ALIGN	alignof(max_align_t)
+
 struct mempool_block
 {
 	struct mempool_block *prev;	/* previous block in the chain */
-	size_t alloc_size;		/* allocated size */
 	size_t size;			/* usable size */
 };
 
-struct mempool_chain
+struct mempool
 {
-	struct mempool_block *last;	/* last block */
-	size_t last_free;		/* free memory in last block */
-	size_t total_size;		/* total size of the chain */
-	size_t num_blocks;		/* number of blocks in the chain */
+	struct mempool_block *blocks;	/* chain of blocks, the last one first */
+	struct mempool_block *big;	/* chain of blocks of big objects */
+	struct mempool_block *unused;	/* chain of released blocks */
+	char *cur;			/* free memory of the last block */
+	char *end;			/* end of the last block */
+	size_t block_size;		/* size of the next block */
 };
 
-struct mempool
+/*
+ * Position in a pool, see `mempool_get_mark'.
+ */
+struct mempool_mark
 {
-	struct mempool_chain small;	/* chain of blocks for small objects */
-	struct mempool_chain big;	/* chain of blocks for big objects */
-	struct mempool_chain unused;	/* chain of unused blocks */
-	size_t block_size;		/* size of small objects block */
-	size_t small_treshold;		/* maximum size of a small object */
+	struct mempool_block *block;	/* the last block */
+	struct mempool_block *big;	/* the last block of big objects */
+	char *cur;			/* free memory of @block */
 };
 
 void mempool_init(struct mempool *pool, size_t block_size);
 void mempool_free(struct mempool *pool);
+void mempool_reset(struct mempool *pool);
+
+struct mempool_mark mempool_get_mark(struct mempool *pool);
+void mempool_release(struct mempool *pool, struct mempool_mark mark);
 
 void *mempool_alloc(struct mempool *pool, size_t size);
+void *mempool_alloc_aligned(struct mempool *pool, size_t size, size_t align);
 char *mempool_memcpy(struct mempool *pool, char *src, size_t len);
 char *mempool_strdup(struct mempool *pool, char *str);
+char *mempool_strndup(struct mempool *pool, char *str, size_t len);
 
 void mempool_print_stats(struct mempool *pool);
 
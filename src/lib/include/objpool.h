@@ -2,24 +2,38 @@
  * objpool:
  * Simple fixed-size allocator.
  *
- * TODO objpool_alloc should return aligned memory
+ * Objects are bump-allocated from blocks, which grow geometrically from the
+ * number of objects given to `objpool_init'. Deallocated objects are kept on
+ * a free list and they're recycled before the blocks are bumped further.
+ * Objects are aligned for any type of their size (up to max_align_t).
+ *
+ * A pool is used by a single thread. Threads which share a pool use a shared
+ * pool (`objpool_shared_init') through caches of their own (magazines, see
+ * `objpool_cache_init'). A cache keeps a few objects at hand and takes the
+ * lock of the shared pool only when it runs out of them or when it's full.
  */
 
 #ifndef OBJPOOL_H
 #define OBJPOOL_H
 
+#include <pthread.h>
+#include <stdalign.h>
+#include <stddef.h>
 #include <stdlib.h>
 
+#define OBJPOOL_ALIGN		alignof(max_align_t)
+#define OBJPOOL_CACHE_SIZE	32
+
 struct objpool
 {
-	void *mry;
-	struct objpool_block *first_block;
-	struct objpool_unused *first_unused;
-	size_t obj_size;
-	size_t block_size;
-	size_t objs_per_block;
-	size_t num_objs;
-	size_t num_blocks;
+	struct objpool_block *first_block;	/* chain of blocks, the last one first */
+	struct objpool_unused *first_unused;	/* free list of deallocated objects */
+	char *cur;				/* free memory of the last block */
+	char *end;				/* end of the last block */
+	size_t obj_size;			/* size of the objects, aligned */
+	size_t objs_per_block;			/* objects in the next block */
+	size_t num_objs;			/* objects allocated */
+	size_t num_blocks;			/* number of blocks */
 };
 
 struct objpool_block
@@ -32,9 +46,38 @@ struct objpool_unused
 	struct objpool_unused *next;
 };
 
+/*
+ * Pool shared by several threads, see `objpool_cache_init'.
+ */
+struct objpool_shared
+{
+	struct objpool pool;			/* the pool */
+	pthread_mutex_t lock;			/* protects @pool */
+};
+
+/*
+ * Per-thread cache (magazine) of objects of a shared pool.
+ */
+struct objpool_cache
+{
+	struct objpool_shared *shared;		/* the shared pool */
+	size_t count;				/* number of @objs */
+	void *objs[OBJPOOL_CACHE_SIZE];		/* objects at hand */
+};
+
 void objpool_init(struct objpool *pool, size_t obj_size, size_t objs_per_block);
 void *objpool_alloc(struct objpool *pool);
 void objpool_dealloc(struct objpool *pool, void *mem);
 void objpool_free(struct objpool *pool);
 
+void objpool_shared_init(struct objpool_shared *shared, size_t obj_size, size_t objs_per_block);
+void objpool_shared_free(struct objpool_shared *shared);
+
+void objpool_cache_init(struct objpool_cache *cache, struct objpool_shared *shared);
+void *objpool_cache_alloc(struct objpool_cache *cache);
+void objpool_cache_dealloc(struct objpool_cache *cache, void *mem);
+void objpool_cache_free(struct objpool_cache *cache);
+
+void objpool_print_stats(struct objpool *pool);
+
 #endif
@@ -0,0 +1,35 @@
+/*
+ * scan:
+ * Scanning of character runs for the lexer. Each scanner returns a pointer
+ * to the first character within [p, end) which doesn't belong to the run,
+ * or @end. Vectorized implementations are used where available, see
+ * `scan_init'.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+
+enum scan_impl
+{
+	SCAN_IMPL_SCALAR,	/* one character at a time */
+	SCAN_IMPL_SSE2,		/* 16 characters at a time */
+	SCAN_IMPL_AVX2,		/* 32 characters at a time */
+};
+
+struct scan_ops
+{
+	const char *name;
+	char *(*name_end)(char *p, char *end);		/* [A-Za-z0-9_] */
+	char *(*number_end)(char *p, char *end);	/* [A-Za-z0-9_.] */
+	char *(*white_end)(char *p, char *end);		/* [ \t\f] */
+	char *(*comment_end)(char *p, char *end);	/* first `*' of `*' `/' */
+};
+
+extern const struct scan_ops *scanner;
+
+bool scan_select(enum scan_impl impl);
+void scan_init(void);
+
+#endif
@@ -0,0 +1,109 @@
+#include "common.h"
+#include "hashtab.h"
+#include "intern.h"
+#include "list.h"
+#include "mempool.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#define SHARD_BITS		6
+#define NUM_SHARDS		(1 << SHARD_BITS)
+#define SHARD_INIT_SIZE		64
+#define ENTRIES_BLOCK_SIZE	4096
+
+/*
+ * An interned string. The string is stored right after the entry, so that
+ * the entry can be found from the string alone (see `intern_entry').
+ */
+struct intern_entry
+{
+	struct hashnode hashnode;	/* allows entries to be hashed, key is @str */
+	intern_id_t id;			/* id of the string */
+	char str[];			/* the string itself */
+};
+
+/*
+ * A shard of the interner. Shards are aligned to cache lines, so that
+ * threads holding the locks of different shards don't share lines.
+ */
+struct intern_shard
+{
+	alignas(64) pthread_mutex_t lock; /* protects all of the below */
+	struct hashtab table;		/* entries by string */
+	struct mempool entries;		/* memory of the entries */
+	intern_id_t count;		/* number of entries */
+};
+
+static struct intern_shard shards[NUM_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void init_shards(void)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		hashtab_init(&shards[i].table, NULL, SHARD_INIT_SIZE);
+		mempool_init(&shards[i].entries, ENTRIES_BLOCK_SIZE);
+		shards[i].count = 0;
+	}
+}
+
+static inline struct intern_entry *intern_entry(const char *istr)
+{
+	return container_of(istr, struct intern_entry, str);
+}
+
+/*
+ * Intern the string @str of length @len, which needn't be NUL-terminated,
+ * and return the interned copy, which is NUL-terminated.
+ */
+char *intern(const char *str, size_t len)
+{
+	return intern_hash(str, len, hashtab_hash(str, len));
+}
+
+/*
+ * Same as `intern', but @hash is the `hashtab_hash' of @str.
+ *
+ * The shard is picked by the top bits of @hash, as the hash tables of the
+ * shards index their slots by the bottom ones.
+ */
+char *intern_hash(const char *str, size_t len, uint32_t hash)
+{
+	struct intern_shard *shard;
+	struct intern_entry *entry;
+
+	pthread_once(&shards_once, init_shards);
+	shard = &shards[hash >> (32 - SHARD_BITS)];
+
+	pthread_mutex_lock(&shard->lock);
+
+	entry = hashtab_search_hash(&shard->table, (char *)str, len, hash);
+	if (!entry) {
+		entry = mempool_alloc(&shard->entries, sizeof(*entry) + len + 1);
+		memcpy(entry->str, str, len);
+		entry->str[len] = '\0';
+		entry->id = shard->count++ << SHARD_BITS | (intern_id_t)(shard - shards);
+		hashtab_insert_nocopy(&shard->table, entry->str, len, hash, &entry->hashnode);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return entry->str;
+}
+
+/*
+ * Return the id of the interned string @istr. Ids are unique, but they
+ * aren't consecutive.
+ */
+intern_id_t intern_id(const char *istr)
+{
+	return intern_entry(istr)->id;
+}
+
+size_t intern_len(const char *istr)
+{
+	return intern_entry(istr)->hashnode.len;
+}
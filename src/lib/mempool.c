@@ -2,126 +2,291 @@
 #include "debug.h"
 #include "mempool.h"
 #include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 
-static void mempool_init_chain(struct mempool_chain *chain)
+#define MEMPOOL_MIN_BLOCK_SIZE	64
+#define MEMPOOL_MAX_BLOCK_SIZE	(256 * 1024)
+
+#define NUM_SIZE_CLASSES	19	/* log2(MEMPOOL_MAX_BLOCK_SIZE) + 1 */
+#define CACHE_CLASS_MAX_SIZE	(4 * 1024 * 1024)
+
+#define BLOCK_HEADER_SIZE \
+	((sizeof(struct mempool_block) + MEMPOOL_ALIGN - 1) & ~(MEMPOOL_ALIGN - 1))
+
+_Static_assert(MEMPOOL_MAX_BLOCK_SIZE >> (NUM_SIZE_CLASSES - 1) == 1,
+	"NUM_SIZE_CLASSES must match MEMPOOL_MAX_BLOCK_SIZE");
+
+/*
+ * Process-wide cache of blocks which were freed with their pools. Regular
+ * blocks (those which don't hold a single big object) have power-of-two
+ * sizes, so the cached blocks are kept by size class, i.e. by log2 of their
+ * size, and a new pool usually finds a block of the size it needs. Each size
+ * class holds at most CACHE_CLASS_MAX_SIZE bytes, the other blocks are freed.
+ */
+static struct
+{
+	pthread_mutex_t lock;				/* protects all of the below */
+	struct mempool_block *blocks[NUM_SIZE_CLASSES];	/* chains of blocks by size class */
+	size_t size[NUM_SIZE_CLASSES];			/* total size of @blocks */
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline char *block_data(struct mempool_block *block)
 {
-	chain->last = NULL;
-	chain->last_free = 0;
-	chain->num_blocks = 0;
-	chain->total_size = 0;
+	return (char *)block + BLOCK_HEADER_SIZE;
+}
+
+static inline size_t size_class(size_t size)
+{
+	assert(size >= MEMPOOL_MIN_BLOCK_SIZE && size <= MEMPOOL_MAX_BLOCK_SIZE);
+	assert((size & (size - 1)) == 0);
+
+	return __builtin_ctzl(size);
 }
 
-static void mempool_free_chain(struct mempool_chain *chain)
+static struct mempool_block *block_new(size_t size)
 {
 	struct mempool_block *block;
-	void *mem;
-
-	while (chain->last) {
-		block = chain->last;
-		chain->last = chain->last->prev;
-		
-		mem = (unsigned char *)block - block->size;
-		DEBUG_PRINTF("About to free raw block at %p", mem);
-
-		chain->num_blocks--;
-		chain->total_size -= block->alloc_size;
-		free(mem);
-	}
+
+	block = mcc_malloc(BLOCK_HEADER_SIZE + size);
+	block->size = size;
+
+	DEBUG_PRINTF("Allocated new block at %p, size = %zu B", (void *)block, size);
+
+	return block;
 }
 
-struct mempool_block *mempool_new_block(struct mempool_chain *chain, size_t size)
+/*
+ * Get a regular block of size @size, from the cache if there's one.
+ */
+static struct mempool_block *block_get(size_t size)
 {
-	// TODO Alignment
+	struct mempool_block *block;
+	size_t class = size_class(size);
 
-	struct mempool_block *new_block;
-	size_t alloc_size;
-	void *mem;
+	pthread_mutex_lock(&cache.lock);
+	block = cache.blocks[class];
+	if (block) {
+		cache.blocks[class] = block->prev;
+		cache.size[class] -= size;
+	}
+	pthread_mutex_unlock(&cache.lock);
 
-	alloc_size = size + sizeof(*new_block);
-	
-	mem = mcc_malloc(alloc_size);
+	return block ? block : block_new(size);
+}
 
-	DEBUG_PRINTF("Alocated new block, alloc_size = %zu B and size = %zu B",
-		alloc_size, size);
-	DEBUG_PRINTF("Raw block starts at %p", mem);
+/*
+ * Put the regular blocks of the chain @blocks to the cache.
+ */
+static void chain_put(struct mempool_block *blocks)
+{
+	struct mempool_block *block;
+	size_t class;
 
-	new_block = (struct mempool_block *)((unsigned char *)mem + size);
+	if (!blocks)
+		return;
 
-	DEBUG_PRINTF("Block trailer resides at %p", (void *)new_block);
+	pthread_mutex_lock(&cache.lock);
+	while (blocks) {
+		block = blocks;
+		blocks = blocks->prev;
+		class = size_class(block->size);
 
-	new_block->alloc_size = alloc_size;
-	new_block->size = size;
+		if (cache.size[class] + block->size <= CACHE_CLASS_MAX_SIZE) {
+			block->prev = cache.blocks[class];
+			cache.blocks[class] = block;
+			cache.size[class] += block->size;
+		}
+		else {
+			free(block);
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
 
-	new_block->prev = chain->last;
-	chain->last = new_block;
+static void chain_free(struct mempool_block *blocks)
+{
+	struct mempool_block *block;
 
-	chain->total_size += alloc_size;
-	chain->num_blocks++;
-	chain->last_free = size;
+	while (blocks) {
+		block = blocks;
+		blocks = blocks->prev;
+		free(block);
+	}
+}
 
-	return new_block;
+/*
+ * Initialize the pool @pool. Its first block will have (about) @block_size
+ * bytes, the following ones twice as many as the previous one, up to
+ * MEMPOOL_MAX_BLOCK_SIZE.
+ */
+void mempool_init(struct mempool *pool, size_t block_size)
+{
+	pool->blocks = NULL;
+	pool->big = NULL;
+	pool->unused = NULL;
+	pool->cur = NULL;
+	pool->end = NULL;
+
+	pool->block_size = MEMPOOL_MIN_BLOCK_SIZE;
+	while (pool->block_size < block_size && pool->block_size < MEMPOOL_MAX_BLOCK_SIZE)
+		pool->block_size *= 2;
 }
 
-static inline void *mempool_alloc_chain(struct mempool_chain *chain, size_t size)
+void mempool_free(struct mempool *pool)
 {
-	size_t free_size;
+	chain_put(pool->blocks);
+	chain_put(pool->unused);
+	chain_free(pool->big);
 
-	free_size = chain->last_free;
-	assert(free_size >= size);
+	pool->blocks = pool->big = pool->unused = NULL;
+	pool->cur = pool->end = NULL;
+}
 
-	assert(chain->last_free >= size);
-	chain->last_free -= size;
+/*
+ * Release all memory allocated from @pool. The blocks are kept for the
+ * allocations which follow.
+ */
+void mempool_reset(struct mempool *pool)
+{
+	mempool_release(pool, (struct mempool_mark) { NULL, NULL, NULL });
+}
 
-	return (unsigned char *)chain->last - free_size;
+/*
+ * Return the current position in @pool, so that all memory allocated after
+ * that can be released at once by `mempool_release'. Marks work as a stack:
+ * releasing to a mark invalidates all marks taken after it.
+ */
+struct mempool_mark mempool_get_mark(struct mempool *pool)
+{
+	return (struct mempool_mark) {
+		.block = pool->blocks,
+		.big = pool->big,
+		.cur = pool->cur,
+	};
 }
 
-void mempool_init(struct mempool *pool, size_t block_size)
+/*
+ * Release all memory allocated from @pool after @mark was taken. Regular
+ * blocks are kept for the allocations which follow, blocks of big objects
+ * are freed.
+ */
+void mempool_release(struct mempool *pool, struct mempool_mark mark)
 {
-	pool->block_size = block_size;
-	pool->small_treshold = block_size / 2;
+	struct mempool_block *block;
 
-	mempool_init_chain(&pool->small);
-	mempool_init_chain(&pool->big);
+	while (pool->blocks != mark.block) {
+		assert(pool->blocks != NULL);
+		block = pool->blocks;
+		pool->blocks = block->prev;
+		block->prev = pool->unused;
+		pool->unused = block;
+	}
+
+	while (pool->big != mark.big) {
+		assert(pool->big != NULL);
+		block = pool->big;
+		pool->big = block->prev;
+		free(block);
+	}
+
+	pool->cur = mark.cur;
+	pool->end = pool->blocks ? block_data(pool->blocks) + pool->blocks->size : NULL;
 }
 
-void *mempool_alloc(struct mempool *pool, size_t size)
+static inline uintptr_t align_up(uintptr_t p, size_t align)
 {
-	DEBUG_PRINTF("Alloc request, size = %zu B", size);
+	return (p + align - 1) & ~(uintptr_t)(align - 1);
+}
 
-	if (size <= pool->small_treshold) {
-		if (pool->small.last_free < size) {
-			DEBUG_MSG("Allocating block in small chain");
-			mempool_new_block(&pool->small, pool->block_size);
-		}
+/*
+ * Allocate @size bytes which don't fit into the last block: in a block of
+ * their own if they're big, in a new regular block otherwise. The new block
+ * is a released one if there's one large enough, or one twice as large as
+ * the previous new block.
+ */
+static void *mempool_alloc_slow(struct mempool *pool, size_t size, size_t align)
+{
+	struct mempool_block *block;
 
-		return mempool_alloc_chain(&pool->small, size);
+	if (size > pool->block_size / 2) {
+		DEBUG_PRINTF("Allocating block for big object, size = %zu B", size);
+		block = block_new(size);
+		block->prev = pool->big;
+		pool->big = block;
+		return block_data(block);
+	}
+
+	if (pool->unused && pool->unused->size >= size) {
+		block = pool->unused;
+		pool->unused = block->prev;
 	}
 	else {
-		DEBUG_MSG("Allocating block in big chain");
-		mempool_new_block(&pool->big, size);
-		return mempool_alloc_chain(&pool->big, size);
+		block = block_get(pool->block_size);
+		if (pool->block_size < MEMPOOL_MAX_BLOCK_SIZE)
+			pool->block_size *= 2;
 	}
+
+	block->prev = pool->blocks;
+	pool->blocks = block;
+	pool->cur = block_data(block);
+	pool->end = pool->cur + block->size;
+
+	return mempool_alloc_aligned(pool, size, align);
 }
 
-void mempool_free(struct mempool *pool)
+/*
+ * Allocate @size bytes aligned to @align, which must be a power of two
+ * not greater than MEMPOOL_ALIGN.
+ */
+void *mempool_alloc_aligned(struct mempool *pool, size_t size, size_t align)
 {
-	mempool_free_chain(&pool->small);
-	mempool_free_chain(&pool->big);
+	uintptr_t p;
+
+	assert(align > 0 && align <= MEMPOOL_ALIGN && (align & (align - 1)) == 0);
+
+	p = align_up((uintptr_t)pool->cur, align);
+	if (!pool->cur || p + size > (uintptr_t)pool->end)
+		return mempool_alloc_slow(pool, size, align);
+
+	pool->cur = (char *)(p + size);
+	return (void *)p;
 }
 
-static void mempool_print_chain_stats(struct mempool_chain *chain)
+/*
+ * Allocate @size bytes aligned for any object.
+ */
+void *mempool_alloc(struct mempool *pool, size_t size)
 {
-	printf("%lu blocks, %lu B total\n", chain->num_blocks, chain->total_size);
+	return mempool_alloc_aligned(pool, size, MEMPOOL_ALIGN);
+}
+
+static void mempool_print_chain_stats(struct mempool_block *blocks)
+{
+	size_t num_blocks = 0;
+	size_t total_size = 0;
+
+	for (; blocks; blocks = blocks->prev) {
+		num_blocks++;
+		total_size += BLOCK_HEADER_SIZE + blocks->size;
+	}
+
+	printf("%zu blocks, %zu B total\n", num_blocks, total_size);
 }
 
 void mempool_print_stats(struct mempool *pool)
 {
 	printf("Mempool stats:\n");
 	printf("\tBig objects chain: ");
-	mempool_print_chain_stats(&pool->big);
+	mempool_print_chain_stats(pool->big);
 	printf("\tSmall objects chain: ");
-	mempool_print_chain_stats(&pool->small);
+	mempool_print_chain_stats(pool->blocks);
+	printf("\tUnused chain: ");
+	mempool_print_chain_stats(pool->unused);
 }
 
 char *mempool_memcpy(struct mempool *pool, char *src, size_t len)
@@ -131,7 +296,7 @@ char *mempool_memcpy(struct mempool *pool, char *src, size_t len)
 	if (!src)
 		return NULL;
 
-	dst = mempool_alloc(pool, len);
+	dst = mempool_alloc_aligned(pool, len, 1);
 
 	DEBUG_EXPR("%lu", len);
 
@@ -139,6 +304,21 @@ char *mempool_memcpy(struct mempool *pool, char *src, size_t len)
 	return dst;
 }
 
+char *mempool_strndup(struct mempool *pool, char *orig, size_t len)
+{
+	char *dup;
+
+	if (!orig)
+		return NULL;
+
+	dup = mempool_alloc_aligned(pool, len + 1, 1);
+
+	memcpy(dup, orig, len);
+	dup[len] = '\0';
+
+	return dup;
+}
+
 char *mempool_strdup(struct mempool *pool, char *orig)
 {
 	char *dup;
@@ -148,10 +328,10 @@ char *mempool_strdup(struct mempool *pool, char *orig)
 		return NULL;
 
 	len = strlen(orig);
-	dup = mempool_alloc(pool, len + 1);
+	dup = mempool_alloc_aligned(pool, len + 1, 1);
 
 	memcpy(dup, orig, len + 1);
 	dup[len] = '\0';
 
-	return dup;	
+	return dup;
 }
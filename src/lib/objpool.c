@@ -3,68 +3,83 @@
 #include "error.h"
 #include "objpool.h"
 #include <assert.h>
-
+#include <stdio.h>
+
+#define OBJPOOL_MAX_BLOCK_SIZE	(64 * 1024)
+
+#define BLOCK_HEADER_SIZE \
+	((sizeof(struct objpool_block) + OBJPOOL_ALIGN - 1) & ~(OBJPOOL_ALIGN - 1))
+
+/*
+ * Initialize the pool @pool of objects of size @obj_size. Its first block
+ * will hold @objs_per_block objects, the following ones twice as many as the
+ * previous one, as long as they don't get larger than OBJPOOL_MAX_BLOCK_SIZE.
+ *
+ * The size of a type is a multiple of its alignment, so the objects are
+ * aligned to the largest power of two which divides @obj_size, up to
+ * OBJPOOL_ALIGN. Sizes which would leave the free list pointers misaligned
+ * are rounded up to a multiple of OBJPOOL_ALIGN.
+ */
 void objpool_init(struct objpool *objpool, size_t obj_size, size_t objs_per_block)
 {
-	size_t min_size;
+	size_t align = MIN(obj_size & -obj_size, OBJPOOL_ALIGN);
 
 	assert(obj_size >= sizeof(struct objpool_unused));
 	assert(objs_per_block > 1);
 
-	objpool->obj_size = obj_size;
+	if (align < sizeof(struct objpool_unused))
+		align = OBJPOOL_ALIGN;
+
+	objpool->obj_size = (obj_size + align - 1) & ~(align - 1);
 	objpool->objs_per_block = objs_per_block;
 	objpool->first_block = NULL;
 	objpool->first_unused = NULL;
+	objpool->cur = NULL;
+	objpool->end = NULL;
 	objpool->num_objs = 0;
 	objpool->num_blocks = 0;
-
-	min_size = obj_size * objs_per_block + sizeof(struct objpool_block);
-	objpool->block_size = min_size;
-
-	while (min_size > objpool->block_size)
-		objpool->block_size *= 2;
 }
 
+/*
+ * Allocate a new block and make it the one the objects are bumped from.
+ * The objects aren't touched until they're allocated.
+ */
 static void alloc_new_block(struct objpool *pool)
 {
 	struct objpool_block *new_block;
-	struct objpool_unused *new_unused;
-	void *mem;
-	size_t i;
+	size_t size = pool->obj_size * pool->objs_per_block;
 
-	new_block = mcc_malloc(pool->block_size);
+	new_block = mcc_malloc(BLOCK_HEADER_SIZE + size);
 
-	DEBUG_PRINTF("Allocated new block, alloc_size = %zu B", pool->block_size);
+	DEBUG_PRINTF("Allocated new block, alloc_size = %zu B", BLOCK_HEADER_SIZE + size);
 
 	new_block->next = pool->first_block;
 	pool->first_block = new_block;
 
-	mem = new_block + 1; /* mem points right after struct objpool_block */
+	pool->cur = (char *)new_block + BLOCK_HEADER_SIZE;
+	pool->end = pool->cur + size;
 
-	for (i = 0; i < pool->objs_per_block; i++) {
-		new_unused = mem;
-		new_unused->next = pool->first_unused;
-		pool->first_unused = new_unused;
-
-		mem = (unsigned char *)mem + pool->obj_size;
-	}
+	if (2 * size <= OBJPOOL_MAX_BLOCK_SIZE)
+		pool->objs_per_block *= 2;
 
 	pool->num_blocks++;
 }
 
 void *objpool_alloc(struct objpool *pool)
 {
-	DEBUG_MSG("Allocating new object from pool");
-
 	void *mem;
 
-	if (pool->first_unused == NULL)
-		alloc_new_block(pool);
-
-	assert(pool->first_unused != NULL);
+	if (pool->first_unused) {
+		mem = pool->first_unused;
+		pool->first_unused = pool->first_unused->next;
+	}
+	else {
+		if (pool->cur == pool->end)
+			alloc_new_block(pool);
 
-	mem = pool->first_unused;
-	pool->first_unused = pool->first_unused->next;
+		mem = pool->cur;
+		pool->cur += pool->obj_size;
+	}
 
 	pool->num_objs++;
 
@@ -84,7 +99,7 @@ void objpool_dealloc(struct objpool *pool, void *mem)
 
 void objpool_free(struct objpool *pool)
 {
-	struct objpool_block *block = pool->first_block;
+	struct objpool_block *block;
 
 	while (pool->first_block) {
 		block = pool->first_block;
@@ -94,7 +109,85 @@ void objpool_free(struct objpool *pool)
 	}
 }
 
+/*
+ * Initialize the pool @shared, which is shared by several threads. It's the
+ * same as `objpool_init', but the pool may only be used through caches.
+ */
+void objpool_shared_init(struct objpool_shared *shared, size_t obj_size, size_t objs_per_block)
+{
+	objpool_init(&shared->pool, obj_size, objs_per_block);
+	pthread_mutex_init(&shared->lock, NULL);
+}
+
+/*
+ * Free all memory of @shared. The caches of the pool must have been freed.
+ */
+void objpool_shared_free(struct objpool_shared *shared)
+{
+	objpool_free(&shared->pool);
+	pthread_mutex_destroy(&shared->lock);
+}
+
+/*
+ * Initialize the cache @cache of objects of @shared. The cache must be used
+ * by a single thread.
+ */
+void objpool_cache_init(struct objpool_cache *cache, struct objpool_shared *shared)
+{
+	cache->shared = shared;
+	cache->count = 0;
+}
+
+/*
+ * Allocate an object from @cache. If the cache is empty, it's refilled with
+ * half of OBJPOOL_CACHE_SIZE objects from the shared pool, under its lock.
+ */
+void *objpool_cache_alloc(struct objpool_cache *cache)
+{
+	struct objpool_shared *shared = cache->shared;
+
+	if (cache->count == 0) {
+		pthread_mutex_lock(&shared->lock);
+		while (cache->count < OBJPOOL_CACHE_SIZE / 2)
+			cache->objs[cache->count++] = objpool_alloc(&shared->pool);
+		pthread_mutex_unlock(&shared->lock);
+	}
+
+	return cache->objs[--cache->count];
+}
+
+/*
+ * Return the object @mem to @cache. If the cache is full, half of its
+ * objects are returned to the shared pool, under its lock.
+ */
+void objpool_cache_dealloc(struct objpool_cache *cache, void *mem)
+{
+	struct objpool_shared *shared = cache->shared;
+
+	if (cache->count == OBJPOOL_CACHE_SIZE) {
+		pthread_mutex_lock(&shared->lock);
+		while (cache->count > OBJPOOL_CACHE_SIZE / 2)
+			objpool_dealloc(&shared->pool, cache->objs[--cache->count]);
+		pthread_mutex_unlock(&shared->lock);
+	}
+
+	cache->objs[cache->count++] = mem;
+}
+
+/*
+ * Return all objects of @cache to the shared pool.
+ */
+void objpool_cache_free(struct objpool_cache *cache)
+{
+	struct objpool_shared *shared = cache->shared;
+
+	pthread_mutex_lock(&shared->lock);
+	while (cache->count > 0)
+		objpool_dealloc(&shared->pool, cache->objs[--cache->count]);
+	pthread_mutex_unlock(&shared->lock);
+}
+
 void objpool_print_stats(struct objpool *pool)
 {
-	printf("objpool stats: %lu objs, %lu blocks\n", pool->num_objs, pool->num_blocks);
+	printf("objpool stats: %zu objs, %zu blocks\n", pool->num_objs, pool->num_blocks);
 }
@@ -0,0 +1,341 @@
+#include "common.h"
+#include "debug.h"
+#include "scan.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86	1
+#include <immintrin.h>
+#else
+#define SCAN_X86	0
+#endif
+
+/******************************** scalar ********************************/
+
+static inline bool is_ident_char(char c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+		|| (c >= '0' && c <= '9') || c == '_';
+}
+
+static inline bool is_white_char(char c)
+{
+	return c == '\t' || c == 0x0C || c == ' ';
+}
+
+static inline char *scalar_name_end(char *p, char *end)
+{
+	while (p < end && is_ident_char(*p))
+		p++;
+
+	return p;
+}
+
+static inline char *scalar_number_end(char *p, char *end)
+{
+	while (p < end && (is_ident_char(*p) || *p == '.'))
+		p++;
+
+	return p;
+}
+
+static inline char *scalar_white_end(char *p, char *end)
+{
+	while (p < end && is_white_char(*p))
+		p++;
+
+	return p;
+}
+
+static inline char *scalar_comment_end(char *p, char *end)
+{
+	for (; p + 1 < end; p++)
+		if (p[0] == '*' && p[1] == '/')
+			return p;
+
+	return end;
+}
+
+static const struct scan_ops scan_scalar = {
+	.name = "scalar",
+	.name_end = scalar_name_end,
+	.number_end = scalar_number_end,
+	.white_end = scalar_white_end,
+	.comment_end = scalar_comment_end,
+};
+
+#if SCAN_X86
+
+/******************************** SSE2 ********************************/
+
+/*
+ * Byte-wise lo <= x <= hi. There are no unsigned byte comparisons in SSE2,
+ * so the range is shifted to start at -128 and compared as signed.
+ */
+static inline __m128i sse2_in_range(__m128i x, char lo, char hi)
+{
+	__m128i shifted = _mm_add_epi8(x, _mm_set1_epi8((char)(-128 - lo)));
+	return _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + (hi - lo + 1))));
+}
+
+static inline __m128i sse2_is_ident(__m128i x)
+{
+	__m128i letter = sse2_in_range(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z');
+	__m128i digit = sse2_in_range(x, '0', '9');
+	__m128i under = _mm_cmpeq_epi8(x, _mm_set1_epi8('_'));
+
+	return _mm_or_si128(_mm_or_si128(letter, digit), under);
+}
+
+static inline __m128i sse2_is_white(__m128i x)
+{
+	__m128i space = _mm_cmpeq_epi8(x, _mm_set1_epi8(' '));
+	__m128i tab = _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'));
+	__m128i ff = _mm_cmpeq_epi8(x, _mm_set1_epi8(0x0C));
+
+	return _mm_or_si128(_mm_or_si128(space, tab), ff);
+}
+
+static inline char *sse2_name_end(char *p, char *end)
+{
+	unsigned mask;
+
+	for (; end - p >= 16; p += 16) {
+		mask = ~_mm_movemask_epi8(sse2_is_ident(_mm_loadu_si128((__m128i *)p))) & 0xFFFF;
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	return scalar_name_end(p, end);
+}
+
+static inline char *sse2_number_end(char *p, char *end)
+{
+	__m128i x;
+	unsigned mask;
+
+	for (; end - p >= 16; p += 16) {
+		x = _mm_loadu_si128((__m128i *)p);
+		mask = ~_mm_movemask_epi8(_mm_or_si128(sse2_is_ident(x),
+			_mm_cmpeq_epi8(x, _mm_set1_epi8('.')))) & 0xFFFF;
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	return scalar_number_end(p, end);
+}
+
+static inline char *sse2_white_end(char *p, char *end)
+{
+	unsigned mask;
+
+	for (; end - p >= 16; p += 16) {
+		mask = ~_mm_movemask_epi8(sse2_is_white(_mm_loadu_si128((__m128i *)p))) & 0xFFFF;
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	return scalar_white_end(p, end);
+}
+
+static inline char *sse2_comment_end(char *p, char *end)
+{
+	__m128i star;
+	__m128i slash;
+	unsigned mask;
+
+	for (; end - p >= 17; p += 16) {
+		star = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)p), _mm_set1_epi8('*'));
+		slash = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(p + 1)), _mm_set1_epi8('/'));
+		mask = _mm_movemask_epi8(_mm_and_si128(star, slash));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	return scalar_comment_end(p, end);
+}
+
+static const struct scan_ops scan_sse2 = {
+	.name = "sse2",
+	.name_end = sse2_name_end,
+	.number_end = sse2_number_end,
+	.white_end = sse2_white_end,
+	.comment_end = sse2_comment_end,
+};
+
+/******************************** AVX2 ********************************/
+
+#define AVX2	__attribute__((target("avx2")))
+
+AVX2 static inline __m256i avx2_in_range(__m256i x, char lo, char hi)
+{
+	__m256i shifted = _mm256_add_epi8(x, _mm256_set1_epi8((char)(-128 - lo)));
+	return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + (hi - lo + 1))), shifted);
+}
+
+AVX2 static inline __m256i avx2_is_ident(__m256i x)
+{
+	__m256i letter = avx2_in_range(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z');
+	__m256i digit = avx2_in_range(x, '0', '9');
+	__m256i under = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_'));
+
+	return _mm256_or_si256(_mm256_or_si256(letter, digit), under);
+}
+
+AVX2 static inline __m256i avx2_is_white(__m256i x)
+{
+	__m256i space = _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' '));
+	__m256i tab = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'));
+	__m256i ff = _mm256_cmpeq_epi8(x, _mm256_set1_epi8(0x0C));
+
+	return _mm256_or_si256(_mm256_or_si256(space, tab), ff);
+}
+
+/*
+ * The AVX2 scanners clear the upper halves of the YMM registers before they
+ * return, so that the (legacy-encoded SSE) code of the caller doesn't pay for
+ * the AVX-SSE transitions.
+ */
+AVX2 static char *avx2_name_end(char *p, char *end)
+{
+	unsigned mask = 0;
+
+	for (; end - p >= 32; p += 32) {
+		mask = ~(unsigned)_mm256_movemask_epi8(avx2_is_ident(_mm256_loadu_si256((__m256i *)p)));
+		if (mask)
+			break;
+	}
+
+	_mm256_zeroupper();
+	return mask ? p + __builtin_ctz(mask) : sse2_name_end(p, end);
+}
+
+AVX2 static char *avx2_number_end(char *p, char *end)
+{
+	__m256i x;
+	unsigned mask = 0;
+
+	for (; end - p >= 32; p += 32) {
+		x = _mm256_loadu_si256((__m256i *)p);
+		mask = ~(unsigned)_mm256_movemask_epi8(_mm256_or_si256(avx2_is_ident(x),
+			_mm256_cmpeq_epi8(x, _mm256_set1_epi8('.'))));
+		if (mask)
+			break;
+	}
+
+	_mm256_zeroupper();
+	return mask ? p + __builtin_ctz(mask) : sse2_number_end(p, end);
+}
+
+AVX2 static char *avx2_white_end(char *p, char *end)
+{
+	unsigned mask = 0;
+
+	for (; end - p >= 32; p += 32) {
+		mask = ~(unsigned)_mm256_movemask_epi8(avx2_is_white(_mm256_loadu_si256((__m256i *)p)));
+		if (mask)
+			break;
+	}
+
+	_mm256_zeroupper();
+	return mask ? p + __builtin_ctz(mask) : sse2_white_end(p, end);
+}
+
+AVX2 static char *avx2_comment_end(char *p, char *end)
+{
+	__m256i star;
+	__m256i slash;
+	unsigned mask = 0;
+
+	for (; end - p >= 33; p += 32) {
+		star = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)p), _mm256_set1_epi8('*'));
+		slash = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(p + 1)), _mm256_set1_epi8('/'));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(star, slash));
+		if (mask)
+			break;
+	}
+
+	_mm256_zeroupper();
+	return mask ? p + __builtin_ctz(mask) : sse2_comment_end(p, end);
+}
+
+static const struct scan_ops scan_avx2 = {
+	.name = "avx2",
+	.name_end = avx2_name_end,
+	.number_end = avx2_number_end,
+	.white_end = avx2_white_end,
+	.comment_end = avx2_comment_end,
+};
+
+#endif
+
+/******************************** public API ********************************/
+
+/*
+ * The scanner in use. Defaults to the scalar one, so that the lexer works
+ * even if `scan_init' was never called.
+ */
+const struct scan_ops *scanner = &scan_scalar;
+
+/*
+ * Select the scanner implementation @impl. Return false (and keep the
+ * current scanner) if @impl isn't supported on this machine.
+ */
+bool scan_select(enum scan_impl impl)
+{
+	switch (impl) {
+	case SCAN_IMPL_SCALAR:
+		scanner = &scan_scalar;
+		return true;
+
+#if SCAN_X86
+	case SCAN_IMPL_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return false;
+		scanner = &scan_sse2;
+		return true;
+
+	case SCAN_IMPL_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return false;
+		scanner = &scan_avx2;
+		return true;
+#endif
+
+	default:
+		return false;
+	}
+}
+
+/*
+ * Select the default scanner, unless the MCC_SCAN environment variable asks
+ * for a particular one (scalar, sse2 or avx2). This allows the
+ * implementations to be compared.
+ *
+ * SSE2 is the default: most runs the lexer scans (names, whitespace) are
+ * shorter than 16 characters, so the wider AVX2 loads rarely pay off and
+ * measured slower than SSE2. AVX2 stays available on request.
+ */
+void scan_init(void)
+{
+	const char *env = getenv("MCC_SCAN");
+
+#if SCAN_X86
+	__builtin_cpu_init();
+#endif
+
+	if (env) {
+		if (strcmp(env, "scalar") == 0 && scan_select(SCAN_IMPL_SCALAR))
+			return;
+		if (strcmp(env, "sse2") == 0 && scan_select(SCAN_IMPL_SSE2))
+			return;
+		if (strcmp(env, "avx2") == 0 && scan_select(SCAN_IMPL_AVX2))
+			return;
+	}
+
+	if (!scan_select(SCAN_IMPL_SSE2))
+		scan_select(SCAN_IMPL_SCALAR);
+
+	DEBUG_EXPR("%s", scanner->name);
+}
@@ -5,8 +5,6 @@
 #include <stdio.h>
 #include <string.h>
 
-#define MAX(a, b) ((a) >= (b) ? (a) : (b))
-
 static void strbuf_resize(struct strbuf *buf, size_t new_size)
 {
 	assert(new_size > 0);
@@ -32,7 +30,7 @@ void strbuf_init(struct strbuf *buf, size_t init_size)
 void strbuf_prepare_write(struct strbuf *buf, size_t count)
 {
 	if (buf->len + count >= buf->size) /* >= because of the '\0' */
-		strbuf_resize(buf, MAX(count, 2 * buf->size));
+		strbuf_resize(buf, MAX(buf->len + count + 1, 2 * buf->size));
 }
 
 void strbuf_putc(struct strbuf *buf, char c)
@@ -41,6 +39,13 @@ void strbuf_putc(struct strbuf *buf, char c)
 	buf->str[buf->len++] = c;
 }
 
+void strbuf_putn(struct strbuf *buf, char *str, size_t len)
+{
+	strbuf_prepare_write(buf, len);
+	memcpy(buf->str + buf->len, str, len);
+	buf->len += len;
+}
+
 void strbuf_putwc(struct strbuf *buf, wchar_t wc)
 {
 	utf8_t bytes[5];
@@ -75,13 +80,7 @@ char *strbuf_strcpy(struct strbuf *buf)
 
 char *strbuf_copy_to_mempool(struct strbuf *buf, struct mempool *pool)
 {
-	char *str;
-
-	str = mempool_alloc(pool, buf->len + 1);
-
-	memcpy(str, buf->str, buf->len + 1);
-	str[buf->len] = '\0';
-	return str;
+	return mempool_strndup(pool, buf->str, buf->len);
 }
 
 void strbuf_reset(struct strbuf *buf)
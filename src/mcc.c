@@ -3,6 +3,7 @@
 #include "error.h"
 #include "symbol.h"
 #include "parse.h"
+#include "scan.h"
 #include "ast.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +20,8 @@ int main(int argc, char *argv[])
 
 	filename = argv[1];
 
+	scan_init();
+
 	parser_init(&parser);
 
 	struct ast tree;
@@ -3,49 +3,89 @@
 #include "error.h"
 #include "symbol.h"
 #include "parse.h"
+#include "scan.h"
 #include "ast.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 /*
  * TODO Global task: make interfaces between components separate, (mainly) hide
  *      implementation of internal structures.
  */
 
-int main(int argc, char *argv[])
+/*
+ * A single input of the batch mode. It's preprocessed by one of the worker
+ * threads, which leaves the output and the errors in memory; they're written
+ * out by the main thread, in the order of the inputs.
+ */
+struct job
+{
+	char *filename;			/* the input file */
+	char *out;			/* output of the preprocessor */
+	size_t out_len;			/* length of @out */
+	char *errs;			/* errors reported */
+	size_t errs_len;		/* length of @errs */
+	bool ok;			/* was the file preprocessed? */
+	bool done;			/* are the above filled in? */
+};
+
+/*
+ * State shared by the worker threads. Every worker has a context and
+ * a preprocessor of its own for each input, the contents of the files
+ * and the results of header searches are shared.
+ */
+struct batch
+{
+	struct job *jobs;		/* the inputs */
+	size_t num_jobs;		/* number of @jobs */
+	size_t next_job;		/* next job to be taken by a worker */
+	struct filecache *filecache;	/* shared file contents */
+	struct cpp_search *search;	/* shared header search */
+	pthread_mutex_t lock;		/* protects @next_job and the jobs' @done */
+	pthread_cond_t job_done;	/* signalled when a job is done */
+};
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-j N] [-I DIR] [-isystem DIR] FILE...\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Preprocess the file @filename in a context of its own, write the output
+ * to @out and the errors to @err. Return false if the file can't be opened.
+ */
+static bool preprocess(struct filecache *filecache, struct cpp_search *search,
+	char *filename, FILE *out, FILE *err)
 {
 	struct context ctx;
-	char *filename;
 	struct cpp *cpp;
 	struct token *token;
-	mcc_error_t err;
+	mcc_error_t open_err;
 	struct strbuf buf;
 	size_t i;
 
-	context_init(&ctx);
-
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
-		exit(EXIT_FAILURE);
-	}
-
-	filename = argv[1];
-
-	cpp = cpp_new(&ctx);
+	context_init_shared(&ctx, filecache);
+	cpp = cpp_new_shared(&ctx, search);
+	cpp_set_streaming(cpp, true); /* each token is printed right away */
 
-	err = cpp_open_file(cpp, filename);
-	if (err != MCC_ERROR_OK) {
-		fprintf(stderr, "Cannot open input file '%s': %s\n",
+	open_err = cpp_open_file(cpp, filename);
+	if (open_err != MCC_ERROR_OK) {
+		fprintf(err, "Cannot open input file '%s': %s\n",
 			filename,
-			error_str(err)
+			error_str(open_err)
 		);
 
 		cpp_delete(cpp);
-		return EXIT_FAILURE;
+		context_free(&ctx);
+		return false;
 	}
 
 	strbuf_init(&buf, 256);
-	for (i = 1; (token = cpp_next(cpp)); i++) {	
+	for (i = 1; (token = cpp_next(cpp)); i++) {
 		if (token_is_eol(token)) {
 			strbuf_putc(&buf, '\n');
 			i = 1;
@@ -60,15 +100,165 @@ int main(int argc, char *argv[])
 			break;
 	}
 
-	printf("%s\n", strbuf_get_string(&buf));
+	fprintf(out, "%s\n", strbuf_get_string(&buf));
 	strbuf_free(&buf);
 
-	errlist_dump(&ctx.errlist, stderr);
+	errlist_dump(&ctx.errlist, err);
 
 	cpp_close_file(cpp);
 	cpp_delete(cpp);
 
 	context_free(&ctx);
 
-	return EXIT_SUCCESS;
+	return true;
+}
+
+static void *worker(void *arg)
+{
+	struct batch *batch = arg;
+	struct job *job;
+	FILE *out;
+	FILE *err;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		job = batch->next_job < batch->num_jobs ? &batch->jobs[batch->next_job++] : NULL;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (!job)
+			break;
+
+		out = open_memstream(&job->out, &job->out_len);
+		err = open_memstream(&job->errs, &job->errs_len);
+		if (!out || !err) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		job->ok = preprocess(batch->filecache, batch->search, job->filename, out, err);
+
+		fclose(out);
+		fclose(err);
+
+		pthread_mutex_lock(&batch->lock);
+		job->done = true;
+		pthread_cond_broadcast(&batch->job_done);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Preprocess the files @filenames on @num_workers threads. The output of
+ * each file is written to stdout, preceded by the name of the file, and its
+ * errors to stderr, in the order of @filenames, whatever the order in which
+ * the files are done. Return false if any of the files can't be opened.
+ */
+static bool preprocess_batch(struct filecache *filecache, struct cpp_search *search,
+	char **filenames, size_t num_files, size_t num_workers)
+{
+	struct batch batch;
+	pthread_t *workers;
+	struct job *job;
+	bool ok = true;
+	size_t i;
+
+	batch.jobs = mcc_malloc(num_files * sizeof(*batch.jobs));
+	batch.num_jobs = num_files;
+	batch.next_job = 0;
+	batch.filecache = filecache;
+	batch.search = search;
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.job_done, NULL);
+
+	for (i = 0; i < num_files; i++) {
+		batch.jobs[i].filename = filenames[i];
+		batch.jobs[i].done = false;
+	}
+
+	num_workers = MAX(MIN(num_workers, num_files), 1);
+	workers = mcc_malloc(num_workers * sizeof(*workers));
+
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&workers[i], NULL, worker, &batch) != 0) {
+			fprintf(stderr, "Cannot create worker thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < num_files; i++) {
+		job = &batch.jobs[i];
+
+		pthread_mutex_lock(&batch.lock);
+		while (!job->done)
+			pthread_cond_wait(&batch.job_done, &batch.lock);
+		pthread_mutex_unlock(&batch.lock);
+
+		printf("==> %s <==\n", job->filename);
+		fwrite(job->out, 1, job->out_len, stdout);
+		fwrite(job->errs, 1, job->errs_len, stderr);
+		ok = ok && job->ok;
+
+		free(job->out);
+		free(job->errs);
+	}
+
+	for (i = 0; i < num_workers; i++)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	pthread_cond_destroy(&batch.job_done);
+	pthread_mutex_destroy(&batch.lock);
+	free(batch.jobs);
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	struct filecache filecache;
+	struct cpp_search *search;
+	char **filenames;
+	size_t num_files;
+	long num_workers;
+	bool ok;
+	int arg;
+
+	scan_init();
+
+	filecache_init(&filecache);
+	search = cpp_search_new();
+	filenames = mcc_malloc(argc * sizeof(*filenames));
+	num_files = 0;
+	num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (arg = 1; arg < argc; arg++) {
+		if (strncmp(argv[arg], "-I", 2) == 0 && argv[arg][2] != '\0')
+			cpp_search_add_dir(search, argv[arg] + 2, false);
+		else if (strcmp(argv[arg], "-I") == 0 && arg + 1 < argc)
+			cpp_search_add_dir(search, argv[++arg], false);
+		else if (strcmp(argv[arg], "-isystem") == 0 && arg + 1 < argc)
+			cpp_search_add_dir(search, argv[++arg], true);
+		else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+			num_workers = atol(argv[++arg]);
+		else if (argv[arg][0] != '-')
+			filenames[num_files++] = argv[arg];
+		else
+			usage(argv[0]);
+	}
+
+	if (num_files == 0 || num_workers < 1)
+		usage(argv[0]);
+
+	if (num_files == 1)
+		ok = preprocess(&filecache, search, filenames[0], stdout, stderr);
+	else
+		ok = preprocess_batch(&filecache, search, filenames, num_files, num_workers);
+
+	free(filenames);
+	cpp_search_delete(search);
+	filecache_free(&filecache);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
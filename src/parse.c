@@ -10,7 +10,7 @@ void parser_setup_symtab(struct symtab *table)
 	size_t i;
 
 	for (i = 0; i < ARRAY_SIZE(kwdinfo); i++) {
-		symbol = symtab_insert(table, kwdinfo[i].name);
+		symbol = symtab_find_or_insert(table, kwdinfo[i].name);
 
 		def = symbol_define(table, symbol);
 		def->type = SYMBOL_TYPE_C_KEYWORD;
@@ -0,0 +1,169 @@
+#include "array.h"
+#include "common.h"
+#include "debug.h"
+#include "srcmgr.h"
+#include <assert.h>
+#include <string.h>
+
+#define FILE_POOL_BLOCK_SIZE	16
+#define FILENAMES_BLOCK_SIZE	1024
+
+/*
+ * Initialize the source manager. The contents of the source files are
+ * obtained from @filecache, which may be shared with other source managers.
+ */
+void srcmgr_init(struct srcmgr *srcmgr, struct filecache *filecache)
+{
+	srcmgr->filecache = filecache;
+	objpool_init(&srcmgr->file_pool, sizeof(struct srcfile), FILE_POOL_BLOCK_SIZE);
+	mempool_init(&srcmgr->filenames, FILENAMES_BLOCK_SIZE);
+	srcmgr->files = array_new(16, sizeof(*srcmgr->files));
+	srcmgr->next_base = SRCLOC_NONE + 1;
+}
+
+void srcmgr_free(struct srcmgr *srcmgr)
+{
+	size_t i;
+
+	for (i = 0; i < array_size(srcmgr->files); i++) {
+		inbuf_close(&srcmgr->files[i]->inbuf);
+		if (srcmgr->files[i]->line_starts)
+			array_delete(srcmgr->files[i]->line_starts);
+	}
+
+	array_delete(srcmgr->files);
+	mempool_free(&srcmgr->filenames);
+	objpool_free(&srcmgr->file_pool);
+}
+
+/*
+ * Open the file @filename and assign it a range of source locations. The
+ * contents of the file are available in `(*file)->inbuf' and they're kept
+ * until the source manager is freed, so that the line tables can be built
+ * whenever they're needed. Every open of a file gets its own `inbuf', but
+ * the contents are shared through the file cache.
+ */
+mcc_error_t srcmgr_open(struct srcmgr *srcmgr, char *filename, struct srcfile **file)
+{
+	struct srcfile *new_file;
+	mcc_error_t err;
+
+	new_file = objpool_alloc(&srcmgr->file_pool);
+
+	err = filecache_open(srcmgr->filecache, filename, &new_file->inbuf);
+	if (err != MCC_ERROR_OK)
+		goto out_dealloc;
+
+	/* one location per byte, plus one for the end of the file */
+	if (new_file->inbuf.count >= UINT32_MAX - srcmgr->next_base) {
+		err = MCC_ERROR_TOOBIG;
+		inbuf_close(&new_file->inbuf);
+		goto out_dealloc;
+	}
+
+	new_file->filename = mempool_strdup(&srcmgr->filenames, filename);
+	new_file->base = srcmgr->next_base;
+	new_file->line_starts = NULL;
+	srcmgr->next_base += new_file->inbuf.count + 1;
+
+	array_push(srcmgr->files, new_file);
+
+	*file = new_file;
+	return MCC_ERROR_OK;
+
+out_dealloc:
+	objpool_dealloc(&srcmgr->file_pool, new_file);
+	return err;
+}
+
+/*
+ * Find the file which contains the location @loc.
+ */
+static struct srcfile *srcmgr_find_file(struct srcmgr *srcmgr, srcloc_t loc)
+{
+	size_t lo = 0;
+	size_t hi = array_size(srcmgr->files);
+	size_t mid;
+
+	if (loc == SRCLOC_NONE || loc >= srcmgr->next_base)
+		return NULL;
+
+	/* find the last file whose base is <= loc */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (srcmgr->files[mid]->base <= loc)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return srcmgr->files[lo];
+}
+
+/*
+ * Build the line table of @file: an array of offsets at which the lines
+ * of @file start.
+ */
+static void srcfile_build_line_starts(struct srcfile *file)
+{
+	char *data = file->inbuf.data;
+	size_t count = file->inbuf.count;
+	char *nl;
+	size_t offset = 0;
+
+	file->line_starts = array_new(count / 32 + 1, sizeof(*file->line_starts));
+	array_push(file->line_starts, 0);
+
+	while (offset < count && (nl = memchr(data + offset, '\n', count - offset))) {
+		offset = nl - data + 1;
+		array_push(file->line_starts, offset);
+	}
+
+	DEBUG_PRINTF("Built line table of %s, %zu lines", file->filename,
+		array_size(file->line_starts));
+}
+
+/*
+ * Decode the location @loc into @location. Return false if @loc is not
+ * a valid location.
+ */
+bool srcmgr_decode(struct srcmgr *srcmgr, srcloc_t loc, struct location *location)
+{
+	struct srcfile *file;
+	uint32_t offset;
+	size_t lo, hi, mid;
+	char *line_end;
+
+	file = srcmgr_find_file(srcmgr, loc);
+	if (!file)
+		return false;
+
+	if (!file->line_starts)
+		srcfile_build_line_starts(file);
+
+	offset = loc - file->base;
+	assert(offset <= file->inbuf.count);
+
+	/* find the last line which starts at or before offset */
+	lo = 0;
+	hi = array_size(file->line_starts);
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (file->line_starts[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	location->filename = file->filename;
+	location->line_no = lo + 1;
+	location->column_no = offset - file->line_starts[lo];
+	location->line = file->inbuf.data + file->line_starts[lo];
+
+	line_end = memchr(location->line, '\n', file->inbuf.count - file->line_starts[lo]);
+	if (!line_end)
+		line_end = file->inbuf.data + file->inbuf.count;
+	location->line_len = line_end - location->line;
+
+	return true;
+}
@@ -1,4 +1,5 @@
 #include "debug.h"
+#include "intern.h"
 #include "mempool.h"
 #include "symbol.h"
 #include "token.h"
@@ -10,12 +11,12 @@
 
 struct symbol *symtab_search(struct symtab *symtab, char *name)
 {
-	return hashtab_search(&symtab->table, name);
+	return hashtab_search(&symtab->table, name, strlen(name));
 }
 
 bool symtab_contains(struct symtab *symtab, char *name)
 {
-	return hashtab_contains(&symtab->table, name);
+	return hashtab_contains(&symtab->table, name, strlen(name));
 }
 
 /*
@@ -66,10 +67,16 @@ void symtab_init(struct symtab *table)
 	list_insert_head(&table->scope_stack, &table->file_scope.scope_stack_node);
 
 	hashtab_init(&table->table, &table->symbol_pool, 256);
+
+	memset(table->reserved, 0, sizeof(table->reserved));
 }
 
 void symtab_free(struct symtab *table)
 {
+	list_foreach(struct symdef, def, &table->file_scope.defs, scope_list_node)
+		if (def->type == SYMBOL_TYPE_CPP_MACRO)
+			macro_free(&def->macro);
+
 	objpool_free(&table->symbol_pool);
 	objpool_free(&table->scope_pool);
 	objpool_free(&table->symdef_pool);
@@ -113,6 +120,10 @@ struct symdef *symbol_define(struct symtab *table, struct symbol *symbol)
 	return symbol->def;
 }
 
+/*
+ * Return the name of @symbol. The name is interned (see `intern'), so the
+ * names of two symbols are equal if and only if they're the same pointer.
+ */
 char *symbol_get_name(struct symbol *symbol)
 {
 	assert(symbol);
@@ -130,9 +141,6 @@ const char *symbol_type_to_string(enum symbol_type type)
 	case SYMBOL_TYPE_CPP_MACRO:
 		return "CPP macro";
 
-	case SYMBOL_TYPE_CPP_MACRO_ARG:
-		return "CPP macro arg";
-
 	case SYMBOL_TYPE_C_KEYWORD:
 		return "C keyword";
 	
@@ -143,23 +151,64 @@ const char *symbol_type_to_string(enum symbol_type type)
 	return NULL;
 }
 
-struct symbol *symtab_insert(struct symtab *table, char *name)
+/*
+ * Insert a new symbol @name of length @len and hash @hash. The name of the
+ * symbol is interned (see `intern') rather than copied to the table, so the
+ * names are shared by all symbol tables of the process and names of symbols
+ * from different tables can be compared by pointer.
+ */
+static struct symbol *symtab_insert_hash(struct symtab *table, char *name, size_t len,
+	uint32_t hash)
 {
 	struct symbol *symbol;
-	
+
 	symbol = symbol_new(table);
-	hashtab_insert(&table->table, name, &symbol->hashnode);
+	hashtab_insert_nocopy(&table->table, intern_hash(name, len, hash), len, hash,
+		&symbol->hashnode);
 
 	return symbol;
 }
 
+struct symbol *symtab_insert(struct symtab *table, char *name)
+{
+	size_t len = strlen(name);
+
+	return symtab_insert_hash(table, name, len, hashtab_hash(name, len));
+}
+
 struct symbol *symtab_find_or_insert(struct symtab *table, char *name)
+{
+	size_t len = strlen(name);
+
+	return symtab_find_or_insert_hash(table, name, len, hashtab_hash(name, len));
+}
+
+/*
+ * Same as `symtab_find_or_insert', but the length @len of @name and its
+ * `hashtab_hash' @hash are known. @name needn't be NUL-terminated.
+ *
+ * Reserved names (C keywords and CPP directive names) are recognized using
+ * a perfect hash (see `reserved_lookup') and their symbols are cached in
+ * `table->reserved', which saves the hash table lookup for the most common
+ * names. The cache is filled lazily, so that it picks up the symbols
+ * inserted by `parser_setup_symtab' and `cpp_setup_symtab_directives'.
+ */
+struct symbol *symtab_find_or_insert_hash(struct symtab *table, char *name, size_t len,
+	uint32_t hash)
 {
 	struct symbol *symbol;
+	int slot;
 
-	symbol = symtab_search(table, name);
+	slot = reserved_lookup(name, len);
+	if (slot >= 0 && table->reserved[slot])
+		return table->reserved[slot];
+
+	symbol = hashtab_search_hash(&table->table, name, len, hash);
 	if (!symbol)
-		symbol = symtab_insert(table, name);
+		symbol = symtab_insert_hash(table, name, len, hash);
+
+	if (slot >= 0)
+		table->reserved[slot] = symbol;
 
 	return symbol;
 }
@@ -214,12 +263,7 @@ void symtab_dump(struct symtab *table, FILE *fout)
 				symbol_type_to_string(def->type));
 
 			if (def->type == SYMBOL_TYPE_CPP_MACRO) {
-				if (def->macro.is_expanding) {
-					fprintf(fout, "(expanding)");
-					fputc('\t', fout);
-				}
 				toklist_dump(&def->macro.expansion, fout);
-
 			}
 			else {
 				fputc('\n', fout);
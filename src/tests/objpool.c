@@ -0,0 +1,174 @@
+/*
+ * Tests of the objpool: alignment, recycling and growth of single-threaded
+ * pools, and a shared pool used by several threads through caches.
+ *
+ * Each object is filled with a stamp of its allocation, unique across all
+ * threads, which is checked before the object is freed, so an object handed
+ * out twice is caught. Run it under the thread sanitizer to check the
+ * locking as well.
+ */
+
+#include "common.h"
+#include "objpool.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NUM_THREADS	8
+#define NUM_ROUNDS	100000
+#define MAX_LIVE	200
+#define OBJ_SIZE	40		/* a multiple of sizeof(uint64_t) */
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+static bool is_aligned(void *mem, size_t align)
+{
+	return ((uintptr_t)mem & (align - 1)) == 0;
+}
+
+static void stamp(uint64_t *obj, uint64_t value)
+{
+	size_t i;
+
+	for (i = 0; i < OBJ_SIZE / sizeof(*obj); i++)
+		obj[i] = value;
+}
+
+static bool has_stamp(uint64_t *obj, uint64_t value)
+{
+	size_t i;
+
+	for (i = 0; i < OBJ_SIZE / sizeof(*obj); i++)
+		if (obj[i] != value)
+			return false;
+
+	return true;
+}
+
+/*
+ * Objects are distinct and aligned for any type of their size, and freed
+ * objects are allocated again before new ones.
+ */
+static void test_single(void)
+{
+	static const size_t sizes[] = { 8, 12, 16, 24, 40, 64, 100, 256 };
+	struct objpool pool;
+	void *objs[1000];
+	void *obj;
+	size_t i, j;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		objpool_init(&pool, sizes[i], 4);
+
+		for (j = 0; j < ARRAY_SIZE(objs); j++) {
+			objs[j] = objpool_alloc(&pool);
+			CHECK(is_aligned(objs[j], MIN(sizes[i] & -sizes[i], OBJPOOL_ALIGN)));
+			CHECK(is_aligned(objs[j], sizeof(void *)));
+			memset(objs[j], 0, sizes[i]);
+			*(size_t *)objs[j] = j;
+		}
+
+		for (j = 0; j < ARRAY_SIZE(objs); j++)
+			CHECK(*(size_t *)objs[j] == j);
+
+		CHECK(pool.num_objs == ARRAY_SIZE(objs));
+		CHECK(pool.num_blocks < 20); /* the blocks grow */
+
+		objpool_dealloc(&pool, objs[10]);
+		obj = objpool_alloc(&pool);
+		CHECK(obj == objs[10]);
+
+		for (j = 0; j < ARRAY_SIZE(objs); j++)
+			objpool_dealloc(&pool, objs[j]);
+
+		CHECK(pool.num_objs == 0);
+		objpool_free(&pool);
+	}
+}
+
+struct worker
+{
+	pthread_t thread;
+	struct objpool_shared *shared;
+	uint64_t id;
+};
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	struct objpool_cache cache;
+	uint64_t *live[MAX_LIVE];
+	uint64_t stamps[MAX_LIVE];
+	size_t num_live = 0;
+	uint64_t *obj;
+	size_t i;
+
+	objpool_cache_init(&cache, w->shared);
+
+	for (i = 0; i < NUM_ROUNDS; i++) {
+		if (num_live < MAX_LIVE && i % 3 != 0) {
+			obj = objpool_cache_alloc(&cache);
+			CHECK(is_aligned(obj, OBJ_SIZE & -OBJ_SIZE));
+			stamps[num_live] = w->id << 32 | i;
+			stamp(obj, stamps[num_live]);
+			live[num_live++] = obj;
+		}
+		else if (num_live > 0) {
+			obj = live[--num_live];
+			CHECK(has_stamp(obj, stamps[num_live]));
+			objpool_cache_dealloc(&cache, obj);
+		}
+	}
+
+	while (num_live > 0) {
+		obj = live[--num_live];
+		CHECK(has_stamp(obj, stamps[num_live]));
+		objpool_cache_dealloc(&cache, obj);
+	}
+
+	objpool_cache_free(&cache);
+
+	return NULL;
+}
+
+/*
+ * Threads allocate from a shared pool and free to it through their caches.
+ */
+static void test_shared(void)
+{
+	struct objpool_shared shared;
+	struct worker workers[NUM_THREADS];
+	size_t i;
+
+	objpool_shared_init(&shared, OBJ_SIZE, 16);
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		workers[i].shared = &shared;
+		workers[i].id = i;
+		CHECK(pthread_create(&workers[i].thread, NULL, worker, &workers[i]) == 0);
+	}
+
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	CHECK(shared.pool.num_objs == 0);
+	objpool_shared_free(&shared);
+}
+
+int main(void)
+{
+	test_single();
+	test_shared();
+
+	printf("objpool: OK\n");
+
+	return EXIT_SUCCESS;
+}
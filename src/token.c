@@ -103,12 +103,6 @@ bool token_is_macro(struct token *token)
 		&& token->symbol->def->type == SYMBOL_TYPE_CPP_MACRO;
 }
 
-bool token_is_macro_arg(struct token *token)
-{
-	return token_is_name(token)
-		&& token->symbol->def->type == SYMBOL_TYPE_CPP_MACRO_ARG;
-}
-
 bool token_is_eof(struct token *token)
 {
 	return token_is(token, TOKEN_EOF);
@@ -192,7 +186,7 @@ void token_print(struct token *token, struct strbuf *buf)
 
 	case TOKEN_STRING_LITERAL:
 		strbuf_putc(buf, '\"');
-		print_string(token->lstr.str, buf);
+		print_string(token->lstr->str, buf);
 		//strbuf_printf(buf, token->str);
 		strbuf_putc(buf, '\"');
 		break;
@@ -213,5 +207,5 @@ void token_dump(struct token *token, FILE *fout)
 
 void location_dump(struct location *loc)
 {
-	fprintf(stderr, "%lu:%lu\n", loc->line_no, loc->column_no);
+	fprintf(stderr, "%" PRIu32 ":%" PRIu32 "\n", loc->line_no, loc->column_no);
 }
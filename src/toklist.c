@@ -1,95 +1,192 @@
-#include "toklist.h"
-#include "inbuf.h"
+#include "common.h"
 #include "context.h"
+#include "inbuf.h"
+#include "toklist.h"
+#include <assert.h>
+#include <stdalign.h>
+#include <string.h>
+
+#define TOKLIST_MIN_SIZE	8
 
 void toklist_init(struct toklist *lst)
 {
-	list_init(&lst->tokens);
+	lst->tokens = NULL;
+	lst->head = 0;
+	lst->count = 0;
+	lst->size = 0;
 }
 
 void toklist_free(struct toklist *lst)
 {
-	list_free(&lst->tokens);
+	free(lst->tokens);
+	toklist_init(lst);
 }
 
-struct token *toklist_first(struct toklist *lst)
+/*
+ * Make room for at least @front more tokens before the first token and @back
+ * more tokens after the last one. If the buffer is at least half empty, the
+ * tokens are just moved within it, otherwise it's grown. Room is only ever
+ * made at the front on request, which keeps lists used as queues (insert at
+ * the back, remove from the front) compact.
+ */
+static void toklist_make_room(struct toklist *lst, size_t front, size_t back)
 {
-	return list_first(&lst->tokens);
-}
+	size_t need = lst->count + front + back;
+	size_t new_head;
 
-struct token *toklist_last(struct toklist *lst)
-{
-	return list_last(&lst->tokens);
-}
+	if (lst->head >= front && lst->size - lst->head - lst->count >= back)
+		return;
 
-struct token *toklist_next(struct token *token)
-{
-	return lnode_next(&token->list_node);
+	if (lst->size < 2 * need) {
+		while (lst->size < 2 * need)
+			lst->size = lst->size ? 2 * lst->size : TOKLIST_MIN_SIZE;
+
+		lst->tokens = mcc_realloc(lst->tokens, lst->size * sizeof(*lst->tokens));
+	}
+
+	/* split the free space evenly if the list grows at the front */
+	new_head = front ? front + (lst->size - need) / 2 : 0;
+
+	memmove(lst->tokens + new_head, lst->tokens + lst->head,
+		lst->count * sizeof(*lst->tokens));
+	lst->head = new_head;
 }
 
-bool toklist_is_empty(struct toklist *lst)
+struct token *toklist_first(struct toklist *lst)
 {
-	return list_empty(&lst->tokens);
+	return toklist_at(lst, 0);
 }
 
-size_t toklist_length(struct toklist *lst)
+struct token *toklist_last(struct toklist *lst)
 {
-	return list_len(&lst->tokens);
+	return lst->count ? lst->tokens[lst->head + lst->count - 1] : NULL;
 }
 
 struct token *toklist_insert_first(struct toklist *lst, struct token *token)
 {
 	assert(!token_is_eol(token));
-	return list_insert_head(&lst->tokens, &token->list_node);
+
+	toklist_make_room(lst, 1, 0);
+	lst->tokens[--lst->head] = token;
+	lst->count++;
+
+	return token;
 }
 
 struct token *toklist_insert(struct toklist *lst, struct token *token)
 {
 	assert(!token_is_eol(token));
-	return list_insert(&lst->tokens, &token->list_node);
+
+	toklist_make_room(lst, 0, 1);
+	lst->tokens[lst->head + lst->count++] = token;
+
+	return token;
+}
+
+/*
+ * Move the tokens from @lst2 to the front (@prepend) or the back of @lst.
+ * @lst2 will be empty.
+ */
+static void toklist_join(struct toklist *lst, struct toklist *lst2, bool prepend)
+{
+	struct toklist tmp;
+
+	if (toklist_is_empty(lst2))
+		return;
+
+	/* just take the buffer over */
+	if (toklist_is_empty(lst)) {
+		tmp = *lst;
+		*lst = *lst2;
+		*lst2 = tmp;
+		return;
+	}
+
+	if (prepend) {
+		toklist_make_room(lst, lst2->count, 0);
+		lst->head -= lst2->count;
+		memcpy(lst->tokens + lst->head, toklist_begin(lst2),
+			lst2->count * sizeof(*lst->tokens));
+	}
+	else {
+		toklist_make_room(lst, 0, lst2->count);
+		memcpy(toklist_end(lst), toklist_begin(lst2),
+			lst2->count * sizeof(*lst->tokens));
+	}
+
+	lst->count += lst2->count;
+	lst2->head = 0;
+	lst2->count = 0;
 }
 
 void toklist_prepend(struct toklist *lst, struct toklist *lst_to_prepend)
 {
-	list_prepend(&lst->tokens, &lst_to_prepend->tokens);
+	toklist_join(lst, lst_to_prepend, true);
 }
 
 void toklist_append(struct toklist *lst, struct toklist *lst_to_append)
 {
-	list_append(&lst->tokens, &lst_to_append->tokens);
+	toklist_join(lst, lst_to_append, false);
 }
 
 struct token *toklist_remove_first(struct toklist *lst)
 {
-	return list_remove_head(&lst->tokens);
+	struct token *token;
+
+	if (toklist_is_empty(lst))
+		return NULL;
+
+	token = lst->tokens[lst->head++];
+	if (--lst->count == 0)
+		lst->head = 0;
+
+	return token;
 }
 
 struct token *toklist_remove_last(struct toklist *lst)
 {
-	return list_remove(&lst->tokens);
+	if (toklist_is_empty(lst))
+		return NULL;
+
+	return lst->tokens[lst->head + --lst->count];
 }
 
-struct token *toklist_remove(struct toklist *lst, struct token *token)
+/*
+ * Remove the first @n tokens of @lst.
+ */
+void toklist_remove_first_n(struct toklist *lst, size_t n)
 {
-	return list_remove_node(&lst->tokens, &token->list_node);
+	assert(n <= lst->count);
+
+	lst->head += n;
+	lst->count -= n;
+	if (lst->count == 0)
+		lst->head = 0;
 }
 
-void toklist_remove_range(struct toklist *lst, struct token *a, struct token *b)
+/*
+ * Append the tokens of @src to @lst, leaving @src unchanged. The tokens
+ * themselves aren't copied, both lists refer to the same tokens.
+ */
+void toklist_extend(struct toklist *lst, struct toklist *src)
 {
-	list_remove_range(&lst->tokens, &a->list_node, &b->list_node);
+	toklist_extend_range(lst, src, 0, src->count);
 }
 
-void toklist_copy(struct context *ctx, struct toklist *src, struct toklist *dst)
+/*
+ * Same as `toklist_extend', but only append the @count tokens of @src
+ * which start at index @first.
+ */
+void toklist_extend_range(struct toklist *lst, struct toklist *src, size_t first, size_t count)
 {
-	struct token *dst_token;
+	assert(first + count <= src->count);
 
-	toklist_foreach(src_token, src) {
-		dst_token = objpool_alloc(&ctx->token_pool);
-		*dst_token = *src_token;
-		toklist_insert(dst, dst_token);
-	}
+	if (count == 0)
+		return;
 
-	/* TODO handle errors */
+	toklist_make_room(lst, 0, count);
+	memcpy(toklist_end(lst), toklist_begin(src) + first, count * sizeof(*lst->tokens));
+	lst->count += count;
 }
 
 void toklist_print(struct toklist *tokens, struct strbuf *buf)
@@ -118,36 +215,50 @@ void toklist_dump(struct toklist *tokens, FILE *fout)
 	strbuf_free(&buf);
 }
 
-void toklist_load_from_strbuf(struct toklist *lst, struct context *ctx, struct strbuf *str)
+/*
+ * Lex @str and append the tokens to @lst. The tokens and their data are
+ * allocated from @scratch if it isn't NULL, or from the token pools of
+ * @ctx otherwise.
+ */
+void toklist_load_from_strbuf(struct toklist *lst, struct context *ctx, struct mempool *scratch,
+	struct strbuf *str)
 {
 	struct inbuf inbuf;
 	struct lexer lexer;
 	struct token *token;
 
 	inbuf_open_mem(&inbuf, strbuf_get_string(str), strbuf_strlen(str));
-	lexer_init(&lexer, ctx, &inbuf);
+	lexer_init(&lexer, ctx, &inbuf, SRCLOC_NONE);
+	if (scratch)
+		lexer.token_data = scratch;
 
+	token = NULL;
 	while (1) {
-		token = objpool_alloc(&ctx->token_pool);
+		if (!token)
+			token = scratch
+				? mempool_alloc_aligned(scratch, sizeof(*token), alignof(struct token))
+				: objpool_alloc(&ctx->token_pool);
 		lexer_next(&lexer, token);
+		token->is_scratch = scratch != NULL;
 		if (token_is_eof(token))
 			break;
 		/* TODO refactoring aid, remove */
-		if (token_is_eol(token)) {
-			objpool_dealloc(&ctx->token_pool, token);
-			continue;
-		}
+		if (token_is_eol(token))
+			continue; /* reuse the token */
 		toklist_insert(lst, token);
+		token = NULL;
 	}
 
 	assert(token_is_eof(token));
-	objpool_dealloc(&ctx->token_pool, token);
+	if (!scratch)
+		objpool_dealloc(&ctx->token_pool, token);
 
 	lexer_free(&lexer);
 	inbuf_close(&inbuf);
 }
 
-void toklist_load_from_string(struct toklist *lst, struct context *ctx, char *fmt, ...)
+void toklist_load_from_string(struct toklist *lst, struct context *ctx, struct mempool *scratch,
+	char *fmt, ...)
 {
 	va_list args;
 	struct strbuf str;
@@ -157,12 +268,7 @@ void toklist_load_from_string(struct toklist *lst, struct context *ctx, char *fm
 	strbuf_vprintf_at(&str, 0, fmt, args);
 	va_end(args);
 
-	toklist_load_from_strbuf(lst, ctx, &str);
+	toklist_load_from_strbuf(lst, ctx, scratch, &str);
 
 	strbuf_free(&str);
 }
-
-bool toklist_contains(struct toklist *lst, struct token *token)
-{
-	return list_contains(&lst->tokens, &token->list_node);
-}
@@ -0,0 +1,5 @@
+/* comment before the guard */
+#ifndef GUARD_H
+#define GUARD_H
+guarded
+#endif
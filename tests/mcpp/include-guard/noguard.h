@@ -0,0 +1,5 @@
+#ifndef NOGUARD_H
+#define NOGUARD_H
+noguard
+#endif
+after_endif
@@ -0,0 +1,4 @@
+#define STR(x) #x
+line __LINE__ file __FILE__
+value X Y
+STR(a   b  X)
@@ -0,0 +1,5 @@
+#ifdef SECOND
+second
+#else
+first
+#endif